@@ -9,13 +9,14 @@
 #include <cstdlib>
 #include <algorithm>
 #include <array>
+#include <thread>
 
 using namespace std;
 using namespace core;
 using namespace ppm;
 
 void syntax() {
-	cerr << "Usage: median_cut_reducer <input_filename>.ppm\n";
+	cerr << "Usage: median_cut_reducer [--no-kmeans] <input_filename>.ppm\n";
 	exit(EXIT_FAILURE);
 }
 
@@ -97,7 +98,121 @@ private:
 	vector<vec3b> colors_;
 };
 
-void median_cut(const string& input_filename) {
+uint32_t distance(const vec3b& c1, const vec3b& c2) {
+	uint32_t tot = 0;
+	for (size_t i = 0; i < 3; ++i) {
+		int32_t d = int32_t(c1[i]) - c2[i];
+		tot += d * d;
+	}
+	return tot;
+}
+
+size_t nearest(const vector<vec3b>& palette, const vec3b& c) {
+	size_t best_index = 0;
+	uint32_t error = UINT32_MAX;
+	for (size_t i = 0; i < palette.size(); ++i) {
+		uint32_t d = distance(c, palette[i]);
+		if (d < error) {
+			best_index = i;
+			error = d;
+		}
+	}
+	return best_index;
+}
+
+// Mapping of the median cut without refinement: the entry whose channels have the closest sum
+size_t nearest_sum(const vector<vec3b>& palette, const vec3b& c) {
+	size_t best_index = 0;
+	uint32_t error = UINT32_MAX;
+	for (size_t i = 0; i < palette.size(); ++i) {
+		int32_t tot = 0;
+		for (size_t j = 0; j < 3; ++j)
+			tot += int32_t(c[j]) - palette[i][j];
+		if (uint32_t(abs(tot)) < error) {
+			best_index = i;
+			error = abs(tot);
+		}
+	}
+	return best_index;
+}
+
+// Distinct colors of the image with their occurrence count, so that k-means works on the histogram
+// and not on every single pixel.
+vector<pair<vec3b, uint32_t>> histogram(const mat<vec3b>& img) {
+	vector<uint32_t> keys;
+	keys.reserve(img.height() * img.width());
+	for (const auto& c : img)
+		keys.push_back((uint32_t(c[0]) << 16) | (uint32_t(c[1]) << 8) | c[2]);
+	sort(begin(keys), end(keys));
+
+	vector<pair<vec3b, uint32_t>> hist;
+	for (size_t i = 0; i < keys.size();) {
+		size_t j = i;
+		while (j < keys.size() && keys[j] == keys[i])
+			++j;
+		vec3b c(uint8_t(keys[i] >> 16), uint8_t(keys[i] >> 8), uint8_t(keys[i]));
+		hist.emplace_back(c, uint32_t(j - i));
+		i = j;
+	}
+
+	return hist;
+}
+
+void kmeans_refine(const mat<vec3b>& img, vector<vec3b>& palette, size_t max_iterations = 32) {
+	auto hist = histogram(img);
+	size_t n_threads = max(1u, thread::hardware_concurrency());
+	n_threads = min(n_threads, max<size_t>(1, hist.size() / 1024));
+
+	// Per-thread accumulators: r, g, b sums and count for every palette entry
+	typedef array<uint64_t, 4> accumulator;
+	vector<vector<accumulator>> partials(n_threads, vector<accumulator>(palette.size()));
+
+	for (size_t it = 0; it < max_iterations; ++it) {
+		vector<thread> workers;
+		size_t chunk = (hist.size() + n_threads - 1) / n_threads;
+		for (size_t t = 0; t < n_threads; ++t) {
+			workers.emplace_back([&, t]() {
+				auto& acc = partials[t];
+				fill(begin(acc), end(acc), accumulator{ 0, 0, 0, 0 });
+				size_t first = min(hist.size(), t * chunk);
+				size_t last = min(hist.size(), first + chunk);
+				for (size_t i = first; i < last; ++i) {
+					const auto& h = hist[i];
+					auto& a = acc[nearest(palette, h.first)];
+					for (size_t j = 0; j < 3; ++j)
+						a[j] += uint64_t(h.first[j]) * h.second;
+					a[3] += h.second;
+				}
+			});
+		}
+		for (auto& w : workers)
+			w.join();
+
+		bool changed = false;
+		for (size_t k = 0; k < palette.size(); ++k) {
+			accumulator sum{ 0, 0, 0, 0 };
+			for (const auto& acc : partials)
+				for (size_t j = 0; j < 4; ++j)
+					sum[j] += acc[k][j];
+			// An empty cluster keeps its median cut color
+			if (sum[3] == 0)
+				continue;
+
+			vec3b color;
+			for (size_t j = 0; j < 3; ++j)
+				color[j] = uint8_t((sum[j] + sum[3] / 2) / sum[3]);
+			for (size_t j = 0; j < 3; ++j)
+				if (color[j] != palette[k][j])
+					changed = true;
+			palette[k] = color;
+		}
+
+		if (!changed)
+			break;
+	}
+}
+
+void median_cut(const string& input_filename, bool refine) {
 	if (!check_extension(input_filename, ".ppm"))
 		error("Input file must be a .ppm file.");
 	ifstream is(input_filename, ios::binary);
@@ -128,22 +243,15 @@ void median_cut(const string& input_filename) {
 	for (auto& bb : boxes)
 		colors.push_back(bb.mean());
 
-	for (auto& c : output) {
-		size_t best_index = 0;
-		uint32_t error = UINT32_MAX;
-		for (size_t i = 0; i < colors.size(); ++i) {
-			vec3b& current_color = colors[i];
-			int32_t tot = 0;
-			for (size_t j = 0; j < 3; ++j)
-				tot += int32_t(c[j]) - current_color[j];
-			tot = abs(tot);
-			if (uint32_t(tot) < error) {
-				best_index = i;
-				error = tot;
-			}
-		}
-		c = colors[best_index];
+	// The refined palette is used with the distance it was computed with
+	if (refine) {
+		kmeans_refine(img, colors);
+		for (auto& c : output)
+			c = colors[nearest(colors, c)];
 	}
+	else
+		for (auto& c : output)
+			c = colors[nearest_sum(colors, c)];
 
 	ofstream os("output.ppm", ios::binary);
 	if (!os)
@@ -153,11 +261,18 @@ void median_cut(const string& input_filename) {
 }
 
 int main(int argc, char **argv) {
-	if (argc != 2)
+	if (argc != 2 && argc != 3)
 		syntax();
 
-	string input(argv[1]);
-	median_cut(input);
+	bool refine = true;
+	if (argc == 3) {
+		if (string(argv[1]) != "--no-kmeans")
+			syntax();
+		refine = false;
+	}
+
+	string input(argv[argc - 1]);
+	median_cut(input, refine);
 	cout << "Done!!\n";
 
 	return EXIT_SUCCESS;
@@ -5,6 +5,10 @@
 #include <cstdint>
 #include <string>
 #include <iterator>
+#include <array>
+#include <algorithm>
+#include <sstream>
+#include <chrono>
 
 using namespace std;
 
@@ -12,6 +16,8 @@ using lz78_pair = pair<uint16_t, int8_t>;
 
 void syntax() {
 	cerr << "Usage: lz78 [c|d] <input_file> <output_file>\n";
+	cerr << "       lz78 b <input_file>\n";
+	cerr << "b compresses and decompresses the file in memory and prints the throughput\n";
 	exit(EXIT_FAILURE);
 }
 
@@ -28,12 +34,21 @@ class stream_bit_reader {
 public:
 	explicit stream_bit_reader(istream& is) : is_(is), buffer_(0), count_(0) {}
 
+	// The bits are taken from the current byte as many at a time as it still has
 	template<typename T>
 	T get(size_t n) {
-		T ret = 0;
-		while (n-- > 0)
-			ret = (ret << 1) | get_bit();
-		return ret;
+		uint32_t ret = 0;
+		while (n > 0) {
+			if (count_ == 0) {
+				is_.read(reinterpret_cast<char*>(&buffer_), 1);
+				count_ = 8;
+			}
+			const uint8_t k = uint8_t(min<size_t>(n, count_));
+			count_ -= k;
+			ret = (ret << k) | ((buffer_ >> count_) & ((1u << k) - 1));
+			n -= k;
+		}
+		return T(ret);
 	}
 
 	bool eos() const {
@@ -46,15 +61,6 @@ private:
 	istream& is_;
 	uint8_t buffer_;
 	uint8_t count_;
-
-	uint8_t get_bit() {
-		if (count_ == 0) {
-			is_.read(reinterpret_cast<char*>(&buffer_), 1);
-			count_ = 8;
-		}
-
-		return (buffer_ >> (--count_)) & 0x01;
-	}
 };
 
 class stream_bit_writer {
@@ -107,41 +113,140 @@ T reverse(T val, size_t size = sizeof(T)) {
 	return ret;
 }
 
-template<typename Iter>
-void compress(Iter first, Iter last, ostream& os, size_t stream_size) {
-	os << "lz78";
-	stream_size = reverse(stream_size);
-	os.write(reinterpret_cast<const char*>(&stream_size), 4);
-
-	stream_bit_writer bw(os);
-	uint16_t last_match_index = 0;
-	vector<lz78_pair> dictionary;
-
-	for (; first != last; ++first) {
-		int8_t b = *first;
-		auto local_p = make_pair(last_match_index, b);
-		auto f = find(begin(dictionary), end(dictionary), local_p);
-		if (f == end(dictionary)) {
-			size_t n_bit = bit_count(dictionary.size());
-			if (n_bit > 0)
-				bw.write(last_match_index, n_bit);
-			bw.write(b, 8);
-			if (dictionary.size() < 4095)
-				dictionary.emplace_back(last_match_index, b);
+// Dictionary of the compressor, as a trie: the entry of a phrase is found from the entry of its prefix and
+// its last byte in an open addressing hash table. Every slot holds the generation of the dictionary which
+// filled it, so clearing the dictionary only starts a new generation and does not touch the table.
+class lz78_dictionary {
+public:
+	static const size_t max_size = 4095;
+
+	lz78_dictionary() : slots_(table_size), size_(0), generation_(1) {}
+
+	size_t size() const {
+		return size_;
+	}
+
+	// Index of the entry (parent, b), 0 if there is not such an entry
+	uint16_t find(uint16_t parent, uint8_t b) const {
+		const uint32_t key = make_key(parent, b);
+		for (size_t i = hash(key);; i = (i + 1) & (table_size - 1)) {
+			const slot& s = slots_[i];
+			if (s.generation != generation_)
+				return 0;
+			if (s.key == key)
+				return s.index;
+		}
+	}
+
+	void insert(uint16_t parent, uint8_t b) {
+		const uint32_t key = make_key(parent, b);
+		size_t i = hash(key);
+		while (slots_[i].generation == generation_)
+			i = (i + 1) & (table_size - 1);
+		++size_;
+		slots_[i] = { key, uint16_t(size_), generation_ };
+		entries_[size_] = make_pair(parent, b);
+	}
+
+	lz78_pair entry(uint16_t index) const {
+		return lz78_pair(entries_[index].first, int8_t(entries_[index].second));
+	}
+
+	void clear() {
+		size_ = 0;
+		++generation_;
+	}
+
+private:
+	// Twice the entries, so that the probe sequences stay short
+	static const size_t table_size = 8192;
+
+	struct slot {
+		uint32_t key;
+		uint16_t index;
+		uint32_t generation;
+	};
+
+	vector<slot> slots_;
+	array<pair<uint16_t, uint8_t>, max_size + 1> entries_;
+	size_t size_;
+	uint32_t generation_;
+
+	static uint32_t make_key(uint16_t parent, uint8_t b) {
+		return (uint32_t(parent) << 8) | b;
+	}
+
+	static size_t hash(uint32_t key) {
+		return (key * 2654435761u) >> (32 - 13);
+	}
+};
+
+class lz78_encoder {
+public:
+	explicit lz78_encoder(ostream& os) : bw_(os), last_match_index_(0) {}
+
+	void encode(const uint8_t* data, size_t size) {
+		for (const uint8_t* end = data + size; data != end; ++data) {
+			const uint8_t b = *data;
+			const uint16_t index = dictionary_.find(last_match_index_, b);
+			if (index == 0) {
+				write_pair(last_match_index_, b);
+				if (dictionary_.size() < lz78_dictionary::max_size)
+					dictionary_.insert(last_match_index_, b);
+				else
+					dictionary_.clear();
+				last_match_index_ = 0;
+			}
 			else
-				dictionary.clear();
-			last_match_index = 0;
+				last_match_index_ = index;
 		}
-		else
-			last_match_index = (f - begin(dictionary)) + 1;
 	}
+
+	// The phrase still matching at the end of the input is written as its prefix and its last byte, which is the
+	// pair of its entry
+	void finish() {
+		if (last_match_index_ != 0) {
+			const lz78_pair p = dictionary_.entry(last_match_index_);
+			write_pair(p.first, uint8_t(p.second));
+			last_match_index_ = 0;
+		}
+		bw_.flush();
+	}
+
+private:
+	stream_bit_writer bw_;
+	lz78_dictionary dictionary_;
+	uint16_t last_match_index_;
+
+	void write_pair(uint16_t index, uint8_t b) {
+		size_t n_bit = bit_count(dictionary_.size());
+		if (n_bit > 0)
+			bw_.write(index, n_bit);
+		bw_.write(b, 8);
+	}
+};
+
+// The input is read in blocks of 1 MiB
+void compress(istream& is, ostream& os, size_t stream_size) {
+	if (stream_size > UINT32_MAX)
+		error("The input file is too big, the size must fit in 32 bits.");
+	os << "lz78";
+	uint32_t size = reverse(uint32_t(stream_size));
+	os.write(reinterpret_cast<const char*>(&size), 4);
+
+	lz78_encoder encoder(os);
+	vector<char> block(1 << 20);
+	while (is) {
+		is.read(block.data(), block.size());
+		encoder.encode(reinterpret_cast<const uint8_t*>(block.data()), size_t(is.gcount()));
+	}
+	encoder.finish();
 }
 
 void lz78_compress(const string& input, const string& output) {
 	ifstream is(input, ios::binary);
 	if (!is)
 		error("Cannot open input file.");
-	is.unsetf(ios::skipws);
 
 	if (!check_extension(output, ".lz78"))
 		error("Output file must be an .lz78 file.");
@@ -152,52 +257,62 @@ void lz78_compress(const string& input, const string& output) {
 	is.seekg(0, ios::end);
 	size_t size = is.tellg();
 	is.seekg(0, ios::beg);
-	compress(istream_iterator<int8_t>(is), istream_iterator<int8_t>(), os, size);
+	compress(is, os, size);
 }
 
-template<typename Iter>
-void decompress(istream& is, Iter out) {
+// Entry of the decompressor dictionary, with the length of its phrase
+struct lz78_entry {
+	uint16_t parent;
+	uint16_t length;
+	uint8_t b;
+};
+
+// Every phrase is written backwards from its last byte, following the parents, straight into the output
+// buffer. The buffer is written when there could be no room for the longest phrase.
+void decompress(istream& is, ostream& os) {
 	string magic = "lz78";
 	copy_n(istream_iterator<char>(is), 4, begin(magic));
 	if (magic != "lz78")
 		error("The file is not an lz78 encoded file.");
 
-	size_t stream_size;
+	uint32_t stream_size;
 	is.read(reinterpret_cast<char*>(&stream_size), 4);
 	stream_size = reverse(stream_size);
 	size_t byte_count = 0;
 
 	stream_bit_reader br(is);
-	vector<lz78_pair> dictionary;
+	vector<lz78_entry> dictionary;
+	dictionary.reserve(4095);
+	const size_t max_phrase = 4096;
+	vector<char> buffer(1 << 20);
+	size_t pos = 0;
 	while (byte_count < stream_size) {
 		uint16_t index = 0;
 		size_t n_bit = bit_count(dictionary.size());
 		if (n_bit > 0)
 			index = br.get<uint16_t>(n_bit);
-		int8_t b = br.get<int8_t>(8);
-		if (index != 0) {
-			uint16_t tmp = index;
-			vector<uint16_t> indexes;
-			while (tmp != 0) {
-				indexes.push_back(tmp);
-				tmp = dictionary[tmp - 1].first;
-			}
-
-			for (auto r_it = rbegin(indexes); r_it != rend(indexes); ++r_it) {
-				*out = dictionary[*r_it - 1].second;
-				++out;
-				++byte_count;
-			}
+		uint8_t b = br.get<uint8_t>(8);
+		if (index > dictionary.size())
+			error("The file is corrupted, a dictionary index is out of range.");
+
+		const uint16_t length = index == 0 ? 1 : dictionary[index - 1].length + 1;
+		if (pos + max_phrase > buffer.size()) {
+			os.write(buffer.data(), pos);
+			pos = 0;
 		}
-		*out = b;
-		++out;
-		++byte_count;
+		char* p = buffer.data() + pos + length;
+		*--p = char(b);
+		for (uint16_t tmp = index; tmp != 0; tmp = dictionary[tmp - 1].parent)
+			*--p = char(dictionary[tmp - 1].b);
+		pos += length;
+		byte_count += length;
 
 		if (dictionary.size() < 4095)
-			dictionary.emplace_back(index, b);
+			dictionary.push_back({ index, length, b });
 		else
 			dictionary.clear();
 	}
+	os.write(buffer.data(), pos);
 }
 
 void lz78_decompress(const string& input, const string& output) {
@@ -211,10 +326,44 @@ void lz78_decompress(const string& input, const string& output) {
 	if (!os)
 		error("Cannot open output file.");
 
-	decompress(is, ostream_iterator<int8_t>(os));
+	decompress(is, os);
+}
+
+// Compresses and decompresses the file in memory, checking that the data comes back unchanged
+void lz78_benchmark(const string& input) {
+	ifstream is(input, ios::binary);
+	if (!is)
+		error("Cannot open input file.");
+	const string data((istreambuf_iterator<char>(is)), istreambuf_iterator<char>());
+
+	using clock = chrono::steady_clock;
+	istringstream original(data);
+	ostringstream compressed;
+	auto start = clock::now();
+	compress(original, compressed, data.size());
+	const double compress_time = chrono::duration<double>(clock::now() - start).count();
+
+	istringstream encoded(compressed.str());
+	encoded.unsetf(ios::skipws);
+	ostringstream decompressed;
+	start = clock::now();
+	decompress(encoded, decompressed);
+	const double decompress_time = chrono::duration<double>(clock::now() - start).count();
+
+	if (decompressed.str() != data)
+		error("The decompressed data is different from the input.");
+
+	const double mb = data.size() / 1e6;
+	cout << "Input: " << data.size() << " bytes, compressed: " << compressed.str().size() << " bytes\n";
+	cout << "Compression: " << compress_time << " s, " << mb / compress_time << " MB/s\n";
+	cout << "Decompression: " << decompress_time << " s, " << mb / decompress_time << " MB/s\n";
 }
 
 int main(int argc, char **argv) {
+	if (argc == 3 && string(argv[1]) == "b") {
+		lz78_benchmark(argv[2]);
+		return EXIT_SUCCESS;
+	}
 	if (argc != 4)
 		syntax();
 
@@ -3,15 +3,21 @@
 #include <cstdint>
 #include <string>
 #include <cstdlib>
-#include <unordered_map>
 #include <stdexcept>
 #include <algorithm>
 #include <iterator>
+#include <sstream>
+#include <vector>
+#include <thread>
 
 using namespace std;
 
 void syntax() {
 	cerr << "Usage: lz78encode <max bits> <input filename> <output filename>\n";
+	cerr << "       lz78encode -b <max bits> <input filename> <output filename>\n";
+	cerr << "       lz78encode -d <input filename> <output filename>\n";
+	cerr << "-b splits the input in blocks with their own dictionary, compressed in parallel\n";
+	cerr << "-d decompresses in parallel a file written with -b\n";
 	exit(EXIT_FAILURE);
 }
 
@@ -62,9 +68,123 @@ private:
 	}
 };
 
-inline void init_dictionary(unordered_map<string, size_t>& dictionary) {
-	dictionary.clear();
-	dictionary[""] = 0;
+class stream_bit_reader {
+public:
+	explicit stream_bit_reader(istream& is) : is_(is), buffer_(0), count_(0) {}
+
+	template<typename T>
+	bool read_value(T& value, size_t n) {
+		value = 0;
+		while (n-- > 0) {
+			if (count_ == 0) {
+				if (!is_.read(reinterpret_cast<char*>(&buffer_), 1))
+					return false;
+				count_ = 8;
+			}
+			value = (value << 1) | ((buffer_ >> --count_) & 0x01);
+		}
+		return true;
+	}
+
+private:
+	istream& is_;
+	uint8_t buffer_;
+	size_t count_;
+};
+
+// Dictionary of the encoder as a trie: the child of a phrase for the next byte is found from the index of the
+// phrase and the byte in an open addressing table. The table doubles when it is half full, up to the size for
+// the most entries which can be inserted, and a reset clears it without freeing its memory.
+class lz78_trie {
+public:
+	explicit lz78_trie(size_t max_entries) : max_slots_(table_size(max_entries)), size_(1) {
+		slots_.resize(min<size_t>(max_slots_, 1 << 12));
+		mask_ = slots_.size() - 1;
+	}
+
+	static size_t table_size(size_t max_entries) {
+		size_t n = 2;
+		while (n < 2 * max_entries)
+			n <<= 1;
+		return n;
+	}
+
+	static size_t memory(size_t max_entries) {
+		return table_size(max_entries) * sizeof(slot);
+	}
+
+	// Number of phrases, the empty one included
+	size_t size() const {
+		return size_;
+	}
+
+	// Index of the child of parent for the byte c, 0 if there is not
+	uint32_t find(uint32_t parent, uint8_t c) const {
+		for (size_t i = hash(parent, c);; i = (i + 1) & mask_) {
+			const slot& s = slots_[i];
+			if (s.child == 0)
+				return 0;
+			if (s.parent == parent && s.c == c)
+				return s.child;
+		}
+	}
+
+	void insert(uint32_t parent, uint8_t c) {
+		if (2 * size_ > slots_.size() && slots_.size() < max_slots_)
+			grow();
+		place({ parent, uint32_t(size_++), c });
+	}
+
+	void reset() {
+		fill(begin(slots_), end(slots_), slot{ 0, 0, 0 });
+		size_ = 1;
+	}
+
+private:
+	// The child 0 marks an empty slot, as the empty phrase is never a child
+	struct slot {
+		uint32_t parent;
+		uint32_t child;
+		uint8_t c;
+	};
+
+	vector<slot> slots_;
+	size_t max_slots_;
+	size_t mask_;
+	size_t size_;
+
+	size_t hash(uint32_t parent, uint8_t c) const {
+		return size_t(((uint64_t(parent) << 8 | c) * 0x9E3779B97F4A7C15ull) >> 32) & mask_;
+	}
+
+	void place(const slot& s) {
+		size_t i = hash(s.parent, s.c);
+		while (slots_[i].child != 0)
+			i = (i + 1) & mask_;
+		slots_[i] = s;
+	}
+
+	void grow() {
+		vector<slot> old(slots_.size() * 2);
+		swap(old, slots_);
+		mask_ = slots_.size() - 1;
+		for (const slot& s : old)
+			if (s.child != 0)
+				place(s);
+	}
+};
+
+// A dictionary never has more entries than the bytes of its input, so its largest table depends on max bits
+// and on the size of the input. If it could pass the limit the encoding is refused before anything is written.
+const size_t max_dictionary_memory = size_t(1) << 30;
+
+inline size_t max_entries(size_t max_bits, size_t input_size) {
+	return min((size_t(1) << max_bits) - 1, input_size);
+}
+
+inline void check_dictionary_memory(size_t max_bits, size_t input_size) {
+	if (lz78_trie::memory(max_entries(max_bits, input_size)) > max_dictionary_memory)
+		error("The dictionary would need more than 1 GiB of memory, use less max bits.");
 }
 
 inline size_t max_used_bits(size_t dict_size) {
@@ -75,43 +195,43 @@ inline size_t max_used_bits(size_t dict_size) {
 	return i;
 }
 
-inline void lz78_encode(istream& is, stream_bit_writer& bw, size_t max_bits) {
-	is.unsetf(ios::skipws);
-	unordered_map<string, size_t> dictionary;
-	init_dictionary(dictionary);
-	size_t max_size = size_t(1) << max_bits;
-	string buffer;
-	size_t current_index = 0;
-	size_t last_inserted_index = 0;
-	char c;
-	while (true) {
-		is >> c;
-		buffer += c;
-		if (is.peek() == EOF)
-			break;
-		auto it = dictionary.find(buffer);
-		if (it != end(dictionary))
-			current_index = it->second;
-		else {
-			size_t n_bits = max_used_bits(last_inserted_index);
-			bw.write_value(current_index, n_bits);
+// The input is read in blocks of 1 MiB and must be at most input_size bytes. The last byte is always written
+// with the phrase matched before it, even if their concatenation is in the dictionary.
+inline void lz78_encode(istream& is, stream_bit_writer& bw, size_t max_bits, size_t input_size) {
+	const size_t max_size = size_t(1) << max_bits;
+	lz78_trie dictionary(max_entries(max_bits, input_size));
+	uint32_t current_index = 0;
+	vector<char> block(1 << 20);
+	while (is) {
+		is.read(block.data(), block.size());
+		const size_t n = size_t(is.gcount());
+		const bool last_block = is.peek() == EOF;
+		for (size_t i = 0; i < n; ++i) {
+			const uint8_t c = uint8_t(block[i]);
+			const uint32_t child = dictionary.find(current_index, c);
+			if (child != 0 && !(last_block && i == n - 1)) {
+				current_index = child;
+				continue;
+			}
+
+			bw.write_value(current_index, max_used_bits(dictionary.size() - 1));
 			bw.write_value(c, 8);
-			if (dictionary.size() == max_size) {
-				last_inserted_index = 0;
-				init_dictionary(dictionary);
+			if (child == 0) {
+				if (dictionary.size() == max_size)
+					dictionary.reset();
+				else
+					dictionary.insert(current_index, c);
 			}
-			else
-				dictionary[buffer] = ++last_inserted_index;
-			buffer.clear();
 			current_index = 0;
 		}
 	}
-	if (!buffer.empty()) {
-		size_t n_bits = max_used_bits(last_inserted_index);
-		bw.write_value(current_index, n_bits);
-		bw.write_value(c, 8);
-	}
-	is.setf(ios::skipws);
+}
+
+inline size_t file_size(istream& is) {
+	is.seekg(0, ios::end);
+	const size_t size = size_t(is.tellg());
+	is.seekg(0, ios::beg);
+	return size;
 }
 
 void encode(size_t max_bits, const string& input_filename, const string& output_filename) {
@@ -120,27 +240,210 @@ void encode(size_t max_bits, const string& input_filename, const string& output_
 	ifstream is(input_filename, ios::binary);
 	if (!is)
 		error("Cannot open the input file.");
+	const size_t input_size = file_size(is);
+	check_dictionary_memory(max_bits, input_size);
 	ofstream os(output_filename, ios::binary);
 	if (!os)
 		error("Cannot open the output file.");
 	os << "LZ78";
 	stream_bit_writer bw(os);
 	bw.write_value(max_bits, 5);
-	lz78_encode(is, bw, max_bits);
+	lz78_encode(is, bw, max_bits, input_size);
+}
+
+/*
+ * Block container: the input is split in blocks and every block is encoded as a stream of its own, starting
+ * from an empty dictionary and padded to a whole byte, so the blocks can be encoded and decoded independently.
+ */
+
+const size_t block_size = size_t(1) << 22;
+
+// Runs f(i) for every i in [0, n), each one on its own thread
+template<typename F>
+void parallel_for(size_t n, F f) {
+	vector<thread> threads;
+	for (size_t i = 1; i < n; ++i)
+		threads.emplace_back(f, i);
+	if (n > 0)
+		f(0);
+	for (auto& t : threads)
+		t.join();
+}
+
+string encode_block(const string& block, size_t max_bits) {
+	istringstream is(block);
+	ostringstream os;
+	{
+		stream_bit_writer bw(os);
+		lz78_encode(is, bw, max_bits, block.size());
+	}
+	return os.str();
+}
+
+struct lz78_entry {
+	uint32_t parent;
+	uint32_t length;
+	char c;
+};
+
+// Decodes the pairs until size bytes have been produced. Every phrase is written backwards from its last
+// byte, following the parents. Returns false if the code is not a valid block.
+bool decode_block(const string& code, size_t max_bits, size_t size, string& block) {
+	istringstream is(code);
+	stream_bit_reader br(is);
+	const size_t max_size = size_t(1) << max_bits;
+	// The entry 0 is the empty phrase
+	vector<lz78_entry> dictionary(1, lz78_entry{ 0, 0, 0 });
+	block.resize(size);
+	size_t pos = 0;
+	while (pos < size) {
+		uint32_t index;
+		uint8_t c;
+		if (!br.read_value(index, max_used_bits(dictionary.size() - 1)) || !br.read_value(c, 8))
+			return false;
+		if (index >= dictionary.size() || dictionary[index].length >= size - pos)
+			return false;
+
+		const uint32_t length = dictionary[index].length + 1;
+		char* p = &block[pos + length];
+		*--p = char(c);
+		for (uint32_t i = index; i != 0; i = dictionary[i].parent)
+			*--p = dictionary[i].c;
+		pos += length;
+
+		if (dictionary.size() == max_size)
+			dictionary.resize(1);
+		else
+			dictionary.push_back({ index, length, char(c) });
+	}
+	return true;
+}
+
+inline size_t batch_size() {
+	return max(1u, thread::hardware_concurrency());
+}
+
+// The integers of the container are written most significant bit first, as the code stream
+inline void write_uint32(ostream& os, uint32_t value) {
+	stream_bit_writer bw(os);
+	bw.write_value(value, 32);
+}
+
+inline bool read_uint32(istream& is, uint32_t& value) {
+	stream_bit_reader br(is);
+	return br.read_value(value, 32);
+}
+
+// The container starts with the magic LZ7B, one byte with max bits and the number of blocks (32 bit). Then
+// every block has its size and the size of its code (32 bit) followed by the code. All the integers are big
+// endian. The blocks are block_size bytes, only the last one can be shorter.
+// The input is read one batch of blocks at a time, one block for every thread, and the codes are written in order.
+void encode_blocks(size_t max_bits, const string& input_filename, const string& output_filename) {
+	if (max_bits < 1 || max_bits > 31)
+		throw invalid_argument("");
+	ifstream is(input_filename, ios::binary);
+	if (!is)
+		error("Cannot open the input file.");
+	const size_t input_size = file_size(is);
+	const size_t n_blocks = (input_size + block_size - 1) / block_size;
+	if (n_blocks > UINT32_MAX)
+		error("The input file is too big.");
+	check_dictionary_memory(max_bits, min(input_size, block_size));
+	ofstream os(output_filename, ios::binary);
+	if (!os)
+		error("Cannot open the output file.");
+	os << "LZ7B";
+	os.put(char(max_bits));
+	write_uint32(os, uint32_t(n_blocks));
+
+	vector<string> blocks(batch_size()), codes(batch_size());
+	for (size_t first = 0; first < n_blocks; first += blocks.size()) {
+		const size_t n = min(blocks.size(), n_blocks - first);
+		for (size_t i = 0; i < n; ++i) {
+			blocks[i].resize(min(block_size, input_size - (first + i) * block_size));
+			is.read(&blocks[i][0], blocks[i].size());
+			if (!is)
+				error("Cannot read the input file.");
+		}
+
+		parallel_for(n, [&](size_t i) {
+			codes[i] = encode_block(blocks[i], max_bits);
+		});
+
+		for (size_t i = 0; i < n; ++i) {
+			write_uint32(os, uint32_t(blocks[i].size()));
+			write_uint32(os, uint32_t(codes[i].size()));
+			os.write(codes[i].data(), codes[i].size());
+		}
+	}
+	if (!os)
+		error("Cannot write the output file.");
+}
+
+void decode_blocks(const string& input_filename, const string& output_filename) {
+	ifstream is(input_filename, ios::binary);
+	if (!is)
+		error("Cannot open the input file.");
+	string magic(4, ' ');
+	is.read(&magic[0], 4);
+	const size_t max_bits = size_t(is.get());
+	uint32_t n_blocks;
+	if (!read_uint32(is, n_blocks) || magic != "LZ7B" || max_bits < 1 || max_bits > 31)
+		error("The input file is not a block lz78 file.");
+	ofstream os(output_filename, ios::binary);
+	if (!os)
+		error("Cannot open the output file.");
+
+	vector<uint32_t> sizes(batch_size());
+	vector<string> codes(batch_size()), blocks(batch_size());
+	vector<char> valid(batch_size());
+	for (size_t first = 0; first < n_blocks; first += codes.size()) {
+		const size_t n = min<size_t>(codes.size(), n_blocks - first);
+		for (size_t i = 0; i < n; ++i) {
+			uint32_t code_size;
+			if (!read_uint32(is, sizes[i]) || !read_uint32(is, code_size) || sizes[i] > block_size)
+				error("The input file is truncated.");
+			codes[i].resize(code_size);
+			is.read(&codes[i][0], code_size);
+			if (!is)
+				error("The input file is truncated.");
+		}
+
+		parallel_for(n, [&](size_t i) {
+			valid[i] = decode_block(codes[i], max_bits, sizes[i], blocks[i]);
+		});
+
+		for (size_t i = 0; i < n; ++i) {
+			if (!valid[i])
+				error("The input file is corrupted.");
+			os.write(blocks[i].data(), blocks[i].size());
+		}
+	}
+	if (!os)
+		error("Cannot write the output file.");
 }
 
 
 int main(int argc, char **argv) {
-	if (argc != 4)
+	if (argc == 4 && string(argv[1]) == "-d") {
+		decode_blocks(argv[2], argv[3]);
+		cout << "Done\n";
+		return EXIT_SUCCESS;
+	}
+	const bool blocks = argc == 5 && string(argv[1]) == "-b";
+	if (argc != 4 && !blocks)
 		syntax();
 	
 	try {
-		size_t max_bits = size_t(stoul(string(argv[1])));
+		size_t max_bits = size_t(stoul(string(argv[argc - 3])));
 
-		string input(argv[2]);
-		string output(argv[3]);
+		string input(argv[argc - 2]);
+		string output(argv[argc - 1]);
 
-		encode(max_bits, input, output);
+		if (blocks)
+			encode_blocks(max_bits, input, output);
+		else
+			encode(max_bits, input, output);
 		cout << "Done\n";
 
 		return EXIT_SUCCESS;
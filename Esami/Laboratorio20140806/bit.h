@@ -0,0 +1,61 @@
+#ifndef BIT_H
+#define BIT_H
+
+#include <cstdint>
+#include <vector>
+#include <stdexcept>
+
+namespace bit {
+
+	// Appends bits, most significant first, to a byte vector
+	class bit_writer {
+	public:
+		explicit bit_writer(std::vector<uint8_t>& out) : out_(out), buffer_(0), count_(0) {}
+
+		void write(const uint32_t val, size_t n) {
+			while (n-- > 0) {
+				buffer_ = uint8_t((buffer_ << 1) | ((val >> n) & 1));
+				if (++count_ == 8) {
+					out_.push_back(buffer_);
+					buffer_ = 0;
+					count_ = 0;
+				}
+			}
+		}
+
+		// Pads the last byte with zeros
+		void flush() {
+			if (count_ > 0)
+				write(0, 8 - count_);
+		}
+
+		~bit_writer() {
+			flush();
+		}
+
+	private:
+		std::vector<uint8_t>& out_;
+		uint8_t buffer_;
+		size_t count_;
+	};
+
+	class bit_reader {
+	public:
+		bit_reader(const uint8_t* data, const size_t size) : data_(data), size_(size), pos_(0) {}
+
+		uint32_t read_bit() {
+			if (pos_ >= size_ * 8)
+				throw std::out_of_range("Read past the end of the bit stream.");
+			const uint32_t b = (data_[pos_ / 8] >> (7 - pos_ % 8)) & 1;
+			++pos_;
+			return b;
+		}
+
+	private:
+		const uint8_t* data_;
+		size_t size_, pos_;
+	};
+
+}
+
+#endif // BIT_H
\ No newline at end of file
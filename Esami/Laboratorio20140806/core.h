@@ -51,6 +51,14 @@ namespace core {
 			data_.resize(width_*height_);
 		}
 
+		T* data() {
+			return data_.data();
+		}
+
+		const T* data() const {
+			return data_.data();
+		}
+
 		auto begin() {
 			return std::begin(data_);
 		}
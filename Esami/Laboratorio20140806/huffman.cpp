@@ -0,0 +1,104 @@
+#include "huffman.h"
+#include <algorithm>
+#include <queue>
+#include <vector>
+#include <stdexcept>
+
+using namespace std;
+using namespace bit;
+using namespace huffman;
+
+
+array<uint8_t, 256> huffman::code_lengths(array<size_t, 256> frequencies) {
+	array<uint8_t, 256> lengths;
+	for (;;) {
+		lengths.fill(0);
+
+		// Nodes are leaves (index < 256) or internal nodes, parents links every node to its parent
+		using node = pair<size_t, size_t>;
+		priority_queue<node, vector<node>, greater<node>> pq;
+		vector<size_t> parents;
+		for (size_t s = 0; s < 256; ++s) {
+			parents.push_back(0);
+			if (frequencies[s] > 0)
+				pq.emplace(frequencies[s], s);
+		}
+		if (pq.empty())
+			return lengths;
+		if (pq.size() == 1) {
+			lengths[pq.top().second] = 1;
+			return lengths;
+		}
+
+		while (pq.size() > 1) {
+			const node n1 = pq.top();
+			pq.pop();
+			const node n2 = pq.top();
+			pq.pop();
+			parents[n1.second] = parents[n2.second] = parents.size();
+			pq.emplace(n1.first + n2.first, parents.size());
+			parents.push_back(0);
+		}
+
+		const size_t root = parents.size() - 1;
+		size_t max_length = 0;
+		for (size_t s = 0; s < 256; ++s) {
+			if (frequencies[s] == 0)
+				continue;
+			size_t length = 0;
+			for (size_t n = s; n != root; n = parents[n])
+				++length;
+			lengths[s] = uint8_t(min<size_t>(length, 255));
+			max_length = max(max_length, length);
+		}
+		if (max_length <= max_code_size)
+			return lengths;
+
+		// Too long codes: flatten the frequencies and build the tree again
+		for (auto& f : frequencies)
+			if (f > 0)
+				f = (f + 1) / 2;
+	}
+}
+
+
+canonical_huffman_encoder::canonical_huffman_encoder(const array<uint8_t, 256>& lengths) : lengths_(lengths), codes_{ 0 } {
+	uint32_t code = 0;
+	for (size_t length = 1; length <= max_code_size; ++length) {
+		for (size_t s = 0; s < 256; ++s)
+			if (lengths_[s] == length)
+				codes_[s] = code++;
+		code <<= 1;
+	}
+}
+
+
+canonical_huffman_decoder::canonical_huffman_decoder(const array<uint8_t, 256>& lengths) :
+											first_code_{ 0 }, count_{ 0 }, first_index_{ 0 }, symbols_{ 0 } {
+	for (size_t s = 0; s < 256; ++s) {
+		if (lengths[s] > max_code_size)
+			throw invalid_argument("Code length not allowed.");
+		++count_[lengths[s]];
+	}
+	count_[0] = 0;
+
+	uint32_t code = 0, index = 0;
+	for (size_t length = 1; length <= max_code_size; ++length) {
+		first_code_[length] = code;
+		first_index_[length] = index;
+		for (size_t s = 0; s < 256; ++s)
+			if (lengths[s] == length)
+				symbols_[index++] = uint8_t(s);
+		code = (code + count_[length]) << 1;
+	}
+}
+
+uint8_t canonical_huffman_decoder::operator()(bit_reader& br) const {
+	uint32_t code = 0;
+	for (size_t length = 1; length <= max_code_size; ++length) {
+		code = (code << 1) | br.read_bit();
+		if (code - first_code_[length] < count_[length])
+			return symbols_[first_index_[length] + code - first_code_[length]];
+	}
+	throw runtime_error("Invalid Huffman code.");
+}
\ No newline at end of file
@@ -0,0 +1,43 @@
+#ifndef HUFFMAN_H
+#define HUFFMAN_H
+
+#include <cstdint>
+#include <array>
+#include "bit.h"
+
+namespace huffman {
+
+	const size_t max_code_size = 15;
+
+	// Code lengths of the bytes with the given frequencies, at most max_code_size bits long. Unused bytes get 0.
+	std::array<uint8_t, 256> code_lengths(std::array<size_t, 256> frequencies);
+
+	// Canonical codes: the codes of a length follow the ones of the shorter lengths, in order of symbol
+	class canonical_huffman_encoder {
+	public:
+		explicit canonical_huffman_encoder(const std::array<uint8_t, 256>& lengths);
+
+		void operator()(const uint8_t symbol, bit::bit_writer& bw) const {
+			bw.write(codes_[symbol], lengths_[symbol]);
+		}
+
+	private:
+		std::array<uint8_t, 256> lengths_;
+		std::array<uint32_t, 256> codes_;
+	};
+
+	class canonical_huffman_decoder {
+	public:
+		explicit canonical_huffman_decoder(const std::array<uint8_t, 256>& lengths);
+
+		uint8_t operator()(bit::bit_reader& br) const;
+
+	private:
+		// For every length: first code, number of codes and position of its first symbol in symbols_
+		std::array<uint32_t, max_code_size + 1> first_code_, count_, first_index_;
+		std::array<uint8_t, 256> symbols_;
+	};
+
+}
+
+#endif // HUFFMAN_H
\ No newline at end of file
@@ -18,8 +18,10 @@ using namespace multires;
  */
 
 void syntax() {
-	cout << "Usage: multires <option> <input filename> <output filename>\n";
-	cout << "<option> could be c for encoding and d for decoding\n";
+	cout << "Usage: multires <option> <input filename> <output filename> [<level>]\n";
+	cout << "<option> could be c for encoding, z for encoding in the compressed v2 format and d for decoding\n";
+	cout << "With a level, d saves only the image of that level and reads only the levels up to it\n";
+	cout << "With - as input filename, d reads a .mlt file (not v2) from the standard input\n";
 	exit(EXIT_FAILURE);
 }
 
@@ -60,9 +62,27 @@ void encode(const string& input_filename, const string& output_filename) {
 	const size_t height = image.height(), width = image.width();
 	os.write(reinterpret_cast<const char*>(&width), sizeof(size_t));
 	os.write(reinterpret_cast<const char*>(&height), sizeof(size_t));
-	multires_encoder encoder(image);
-	for (const auto& level : encoder)
-		copy(begin(level), end(level), ostream_iterator<uint8_t>(os));
+	if (!multires_encoder::write_levels(os, image))
+		error("Error on writing the output file.");
+}
+
+void encode_v2(const string& input_filename, const string& output_filename) {
+	if (!check_extension(input_filename, ".pgm"))
+		error("Input file must be a .pgm file.");
+	ifstream is(input_filename, ios::binary);
+	if (!is)
+		error("Error on opening the input file.");
+
+	mat<uint8_t> image;
+	if (!read_pgm(is, image))
+		error("Error during reading the input image.");
+
+	ofstream os(output_filename + ".mlt", ios::binary);
+	if (!os)
+		error("Error on output file.");
+
+	if (!multires_v2::write(os, image))
+		error("Error on writing the output file.");
 }
 
 /*
@@ -73,37 +93,89 @@ void encode(const string& input_filename, const string& output_filename) {
  * Decoding
  */
 
-void decode(const string& input_filename, const string& output_filename) {
-	if (!check_extension(input_filename, ".mlt"))
-		error("Input file must be a .mlt file.");
-	ifstream is(input_filename, ios::binary);
-	is.unsetf(ios::skipws);
-	if (!is)
-		error("Error on opening the input file.");
-	
-	string magic;
-	copy_n(istream_iterator<char>(is), 8, back_inserter(magic));
-	
-	if (magic != "MULTIRES")
-		error("Input file is not a multires file.");
-	
-	size_t width, height;
-	is.read(reinterpret_cast<char*>(&width), sizeof(size_t));
-	is.read(reinterpret_cast<char*>(&height), sizeof(size_t));
-
-	multires_decoder decoder(height, width, istream_iterator<uint8_t>(is), istream_iterator<uint8_t>());
-
-	for (size_t i = 1; i <= 7; ++i) {
-		stringstream ss;
-		ss << output_filename << "_" << i << ".pgm";
-		ofstream os(ss.str(), ios::binary);
-		const mat<uint8_t> r_image = decoder.decode_level(i);
-		if (!write_pgm(os, r_image)) {
-			ss.clear();
-			ss << "Error on writing the image with level " << i << ".";
-			error(ss.str());
+void save_level(const string& output_filename, const size_t level, const mat<uint8_t>& image) {
+	stringstream ss;
+	ss << output_filename << "_" << level << ".pgm";
+	ofstream os(ss.str(), ios::binary);
+	if (!write_pgm(os, image)) {
+		ss.str("");
+		ss << "Error on writing the image with level " << level << ".";
+		error(ss.str());
+	}
+}
+
+// The levels up to last_level are read through the offset table and decompressed in parallel, then refined in order
+void decode_v2(istream& is, const string& output_filename, const size_t last_level, const bool save_all) {
+	try {
+		multires_v2_reader reader(is);
+		const auto levels = reader.read_levels(last_level);
+		multires_progressive_decoder decoder(reader.height(), reader.width());
+		for (const auto& level : levels) {
+			decoder.refine(level.data());
+			if (save_all || decoder.level() == last_level)
+				save_level(output_filename, decoder.level(), decoder.image());
+		}
+	}
+	catch (const exception& e) {
+		error(e.what());
+	}
+}
+
+// The input is read in small pieces and every level is saved as soon as its bytes have arrived. With - as
+// input filename the file is read from the standard input, so the first levels can be shown while it is
+// still being received. A level from 1 to 7 saves only that one, 0 saves all of them.
+void decode(const string& input_filename, const string& output_filename, const size_t level) {
+	const size_t last_level = level == 0 ? 7 : level;
+	ifstream file;
+	if (input_filename != "-") {
+		if (!check_extension(input_filename, ".mlt"))
+			error("Input file must be a .mlt file.");
+		file.open(input_filename, ios::binary);
+		if (!file)
+			error("Error on opening the input file.");
+
+		// Version 2 files are read by offset
+		string magic(multires_v2::magic.size(), ' ');
+		file.read(&magic[0], magic.size());
+		file.clear();
+		file.seekg(0);
+		if (magic == multires_v2::magic) {
+			decode_v2(file, output_filename, last_level, level == 0);
+			return;
 		}
 	}
+	else
+		// The standard input gets its own buffer, so that the bytes already received can be taken at once
+		ios::sync_with_stdio(false);
+	istream& is = input_filename == "-" ? cin : file;
+
+	auto on_level = [&](const size_t l, const mat<uint8_t>& image) {
+		if (level == 0 || l == level)
+			save_level(output_filename, l, image);
+	};
+
+	multires_stream_decoder decoder;
+	vector<char> chunk(1 << 16);
+	try {
+		while (decoder.level() < last_level && is) {
+			// Waits only for the first byte and then takes what is already buffered, so a level is not held
+			// back until a whole chunk has arrived
+			is.read(chunk.data(), 1);
+			size_t size = size_t(is.gcount());
+			if (size > 0)
+				size += size_t(is.readsome(chunk.data() + 1, chunk.size() - 1));
+			decoder.feed(reinterpret_cast<const uint8_t*>(chunk.data()), size, on_level);
+		}
+	}
+	catch (const exception& e) {
+		error(e.what());
+	}
+
+	if (decoder.level() < last_level) {
+		stringstream ss;
+		ss << "The input file is truncated, only " << decoder.level() << " levels have been decoded.";
+		error(ss.str());
+	}
 }
 
 /*
@@ -112,20 +184,29 @@ void decode(const string& input_filename, const string& output_filename) {
 
 
 int main(const int argc, char **argv) {
-	if (argc != 4)
+	if (argc != 4 && argc != 5)
 		syntax();
 
 	const string option(argv[1]);
 	const string input_filename(argv[2]);
 	const string output_filename(argv[3]);
+	size_t level = 0;
+	if (argc == 5) {
+		level = strtoul(argv[4], nullptr, 10);
+		if (option != "d" || level < 1 || level > 7)
+			syntax();
+	}
 
 	if (option == "c")
 		encode(input_filename, output_filename);
 	else
-		if (option == "d")
-			decode(input_filename, output_filename);
+		if (option == "z")
+			encode_v2(input_filename, output_filename);
 		else
-			error("Option not recognized. Allowed options are c for encoding and d for decoding.\n");
+			if (option == "d")
+				decode(input_filename, output_filename, level);
+			else
+				error("Option not recognized. Allowed options are c and z for encoding and d for decoding.\n");
 
 	cout << "Done!!\n";
 
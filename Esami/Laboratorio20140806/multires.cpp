@@ -1,4 +1,9 @@
 #include "multires.h"
+#include "huffman.h"
+#include <algorithm>
+#include <string>
+#include <cstdlib>
+#include <thread>
 
 using namespace std;
 using namespace core;
@@ -16,14 +21,57 @@ const core::mat<size_t> _multires_base::adam7_mat = core::mat<size_t>(8, 8,
 		5, 6, 5, 6, 5, 6, 5, 6,
 		7, 7, 7, 7, 7, 7, 7, 7}.data());
 
+const array<adam7_pass, 7> _multires_base::adam7_passes{ {
+	{ 0, 0, 8, 8 },
+	{ 0, 4, 8, 8 },
+	{ 4, 0, 8, 4 },
+	{ 0, 2, 4, 4 },
+	{ 2, 0, 4, 2 },
+	{ 0, 1, 2, 2 },
+	{ 1, 0, 2, 1 }
+} };
 
+
+void multires_encoder::gather_row(const uint8_t* row, const size_t column, const size_t column_step,
+								  const size_t width, uint8_t* out) {
+	// The last level takes whole rows
+	if (column_step == 1) {
+		copy(row + column, row + width, out);
+		return;
+	}
+	for (size_t c = column; c < width; c += column_step)
+		*out++ = row[c];
+}
+
+// Every level is a regular sub-lattice of the image, so its size is known and it is gathered row by row
 multires_encoder::multires_encoder(const core::mat<uint8_t>& image) {
-	for (size_t r = 0; r < image.height(); ++r) {
-		for (size_t c = 0; c < image.width(); ++c) {
-			const size_t level = adam7_mat(r % 8, c % 8);
-			levels_[level - 1].emplace_back(image(r, c));
+	const size_t height = image.height(), width = image.width();
+	for (size_t l = 0; l < 7; ++l) {
+		const adam7_pass& p = adam7_passes[l];
+		levels_[l].resize(level_size(l + 1, height, width));
+		if (levels_[l].empty())
+			continue;
+
+		const size_t columns = (width - p.column + p.column_step - 1) / p.column_step;
+		uint8_t* out = levels_[l].data();
+		for (size_t r = p.row; r < height; r += p.row_step, out += columns)
+			gather_row(image.data() + r * width, p.column, p.column_step, width, out);
+	}
+}
+
+bool multires_encoder::write_levels(ostream& os, const core::mat<uint8_t>& image) {
+	const size_t height = image.height(), width = image.width();
+	vector<uint8_t> row(width);
+	for (const auto& p : adam7_passes) {
+		if (p.column >= width)
+			continue;
+		const size_t columns = (width - p.column + p.column_step - 1) / p.column_step;
+		for (size_t r = p.row; r < height; r += p.row_step) {
+			gather_row(image.data() + r * width, p.column, p.column_step, width, row.data());
+			os.write(reinterpret_cast<const char*>(row.data()), columns);
 		}
 	}
+	return os.good();
 }
 
 vector<uint8_t>& multires_encoder::get(const size_t index) const {
@@ -41,4 +89,273 @@ const vector<uint8_t>& multires_encoder::operator[](const size_t index) const {
 }
 
 
+void multires_progressive_decoder::refine(const uint8_t* samples) {
+	if (level_ == 7)
+		throw logic_error("All the levels have been decoded.");
+
+	const adam7_pass& p = adam7_passes[level_];
+	++level_;
+
+	// After level l the blocks are as large as the lattice of the levels up to l: the steps of the next pass,
+	// or single pixels after the last one
+	size_t block_height = 1, block_width = 1;
+	if (level_ < 7) {
+		block_height = adam7_passes[level_].row_step;
+		block_width = adam7_passes[level_].column_step;
+	}
+
+	const size_t height = image_.height(), width = image_.width();
+	uint8_t* data = image_.data();
+	for (size_t r = p.row; r < height; r += p.row_step) {
+		const size_t block_end = min(r + block_height, height);
+		for (size_t c = p.column; c < width; c += p.column_step) {
+			const uint8_t value = *samples++;
+			const size_t block_columns = min(block_width, width - c);
+			for (size_t br = r; br < block_end; ++br)
+				fill_n(data + br * width + c, block_columns, value);
+		}
+	}
+}
+
+void multires_stream_decoder::read_header() {
+	if (string(begin(pending_), begin(pending_) + 8) != "MULTIRES")
+		throw runtime_error("Input file is not a multires file.");
+
+	size_t width, height;
+	copy_n(pending_.data() + 8, sizeof(size_t), reinterpret_cast<uint8_t*>(&width));
+	copy_n(pending_.data() + 8 + sizeof(size_t), sizeof(size_t), reinterpret_cast<uint8_t*>(&height));
+	decoder_ = multires_progressive_decoder(height, width);
+	pending_.erase(begin(pending_), begin(pending_) + header_size);
+	header_read_ = true;
+}
+
+
+const string multires_v2::magic = "MULTIRV2";
+
+// Little endian integers of the v2 header
+static void write_le(ostream& os, uint64_t val, const size_t bytes) {
+	for (size_t i = 0; i < bytes; ++i, val >>= 8)
+		os.put(char(val & 0xFF));
+}
+
+static uint64_t read_le(istream& is, const size_t bytes) {
+	uint64_t val = 0;
+	for (size_t i = 0; i < bytes; ++i)
+		val |= uint64_t(uint8_t(is.get())) << (8 * i);
+	return val;
+}
+
+// PNG filters: none, sub, up, average and Paeth. a is the sample on the left, b the one above and c the one
+// above on the left, 0 outside the lattice.
+static uint8_t predict(const uint8_t filter, const int a, const int b, const int c) {
+	switch (filter) {
+	case 1:
+		return uint8_t(a);
+	case 2:
+		return uint8_t(b);
+	case 3:
+		return uint8_t((a + b) / 2);
+	case 4: {
+		const int p = a + b - c;
+		const int pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+		return uint8_t(pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+	}
+	default:
+		return 0;
+	}
+}
+
+// Every row gets the filter with the smallest sum of the residuals taken as signed bytes, as PNG encoders do
+void multires_v2::filter_rows(const uint8_t* samples, const size_t rows, const size_t columns, vector<uint8_t>& out) {
+	const vector<uint8_t> zeros(columns, 0);
+	vector<uint8_t> candidate(columns), best(columns);
+	for (size_t r = 0; r < rows; ++r) {
+		const uint8_t* row = samples + r * columns;
+		const uint8_t* above = r > 0 ? row - columns : zeros.data();
+		size_t best_sum = SIZE_MAX;
+		uint8_t best_filter = 0;
+		for (uint8_t filter = 0; filter < 5; ++filter) {
+			size_t sum = 0;
+			for (size_t c = 0; c < columns; ++c) {
+				const int a = c > 0 ? row[c - 1] : 0, b = above[c], ab = c > 0 ? above[c - 1] : 0;
+				candidate[c] = uint8_t(row[c] - predict(filter, a, b, ab));
+				sum += candidate[c] < 128 ? candidate[c] : 256 - candidate[c];
+			}
+			if (sum < best_sum) {
+				best_sum = sum;
+				best_filter = filter;
+				swap(best, candidate);
+			}
+		}
+		out.push_back(best_filter);
+		out.insert(end(out), begin(best), end(best));
+	}
+}
+
+void multires_v2::unfilter_rows(const uint8_t* filtered, const size_t rows, const size_t columns, uint8_t* samples) {
+	const vector<uint8_t> zeros(columns, 0);
+	for (size_t r = 0; r < rows; ++r, filtered += columns + 1) {
+		const uint8_t filter = filtered[0];
+		if (filter > 4)
+			throw runtime_error("Filter not defined.");
+		uint8_t* row = samples + r * columns;
+		const uint8_t* above = r > 0 ? row - columns : zeros.data();
+		for (size_t c = 0; c < columns; ++c) {
+			const int a = c > 0 ? row[c - 1] : 0, b = above[c], ab = c > 0 ? above[c - 1] : 0;
+			row[c] = uint8_t(filtered[c + 1] + predict(filter, a, b, ab));
+		}
+	}
+}
+
+// A level is a mode byte followed by the filtered rows, or by the code lengths as 128 bytes of two 4 bit
+// lengths and the coded filtered rows
+vector<uint8_t> multires_v2::compress_level(const vector<uint8_t>& samples, const size_t rows, const size_t columns) {
+	vector<uint8_t> filtered;
+	filtered.reserve(rows * (columns + 1));
+	filter_rows(samples.data(), rows, columns, filtered);
+
+	array<size_t, 256> frequencies{ 0 };
+	for (const auto s : filtered)
+		++frequencies[s];
+	const array<uint8_t, 256> lengths = huffman::code_lengths(frequencies);
+
+	vector<uint8_t> block{ uint8_t(level_mode::huffman) };
+	for (size_t s = 0; s < 256; s += 2)
+		block.push_back(uint8_t(lengths[s] << 4 | lengths[s + 1]));
+	{
+		huffman::canonical_huffman_encoder encoder(lengths);
+		bit::bit_writer bw(block);
+		for (const auto s : filtered)
+			encoder(s, bw);
+	}
+
+	if (block.size() < 1 + filtered.size())
+		return block;
+	block.assign(1, uint8_t(level_mode::stored));
+	block.insert(end(block), begin(filtered), end(filtered));
+	return block;
+}
+
+vector<uint8_t> multires_v2::decompress_level(const vector<uint8_t>& block, const size_t rows, const size_t columns) {
+	const size_t filtered_size = rows * (columns + 1);
+	if (block.empty())
+		throw runtime_error("Empty level.");
+
+	vector<uint8_t> filtered;
+	if (block[0] == uint8_t(level_mode::stored)) {
+		if (block.size() != 1 + filtered_size)
+			throw runtime_error("Wrong size of a stored level.");
+		filtered.assign(begin(block) + 1, end(block));
+	}
+	else {
+		if (block[0] != uint8_t(level_mode::huffman) || block.size() < 1 + 128)
+			throw runtime_error("Level mode not defined.");
+		array<uint8_t, 256> lengths;
+		for (size_t s = 0; s < 256; s += 2) {
+			lengths[s] = block[1 + s / 2] >> 4;
+			lengths[s + 1] = block[1 + s / 2] & 0x0F;
+		}
+		huffman::canonical_huffman_decoder decoder(lengths);
+		bit::bit_reader br(block.data() + 1 + 128, block.size() - 1 - 128);
+		filtered.resize(filtered_size);
+		for (auto& s : filtered)
+			s = decoder(br);
+	}
+
+	vector<uint8_t> samples(rows * columns);
+	unfilter_rows(filtered.data(), rows, columns, samples.data());
+	return samples;
+}
+
+bool multires_v2::write(ostream& os, const core::mat<uint8_t>& image) {
+	const size_t height = image.height(), width = image.width();
+	const multires_encoder encoder(image);
+
+	// One thread per level. The last level holds half of the samples, so it bounds the time.
+	array<vector<uint8_t>, 7> blocks;
+	vector<thread> threads;
+	for (size_t l = 0; l < 7; ++l)
+		threads.emplace_back([&, l]() {
+			blocks[l] = compress_level(encoder[l], level_rows(l + 1, height), level_columns(l + 1, width));
+		});
+	for (auto& t : threads)
+		t.join();
+
+	os << magic;
+	write_le(os, width, 4);
+	write_le(os, height, 4);
+	uint64_t offset = header_size;
+	for (const auto& block : blocks) {
+		write_le(os, offset, 8);
+		offset += block.size();
+	}
+	write_le(os, offset, 8);
+	for (const auto& block : blocks)
+		os.write(reinterpret_cast<const char*>(block.data()), block.size());
+
+	return os.good();
+}
+
+
+multires_v2_reader::multires_v2_reader(istream& is): is_(is), height_(0), width_(0), offsets_{ 0 } {
+	string m(magic.size(), ' ');
+	is_.read(&m[0], m.size());
+	if (!is_ || m != magic)
+		throw runtime_error("Input file is not a multires v2 file.");
+
+	width_ = size_t(read_le(is_, 4));
+	height_ = size_t(read_le(is_, 4));
+	for (auto& offset : offsets_)
+		offset = read_le(is_, 8);
+	if (!is_)
+		throw runtime_error("The header of the input file is truncated.");
+	for (size_t i = 0; i < 7; ++i)
+		if (offsets_[i] > offsets_[i + 1] || (i == 0 && offsets_[0] < header_size))
+			throw runtime_error("Wrong offset table.");
+}
+
+vector<uint8_t> multires_v2_reader::read_block(const size_t level) {
+	vector<uint8_t> block(size_t(offsets_[level] - offsets_[level - 1]));
+	is_.seekg(offsets_[level - 1]);
+	is_.read(reinterpret_cast<char*>(block.data()), block.size());
+	if (!is_)
+		throw runtime_error("The input file is truncated.");
+	return block;
+}
+
+vector<uint8_t> multires_v2_reader::read_level(const size_t level) {
+	if (level < 1 || level > 7)
+		throw invalid_argument("Level not allowed.");
+	return decompress_level(read_block(level), level_rows(level, height_), level_columns(level, width_));
+}
+
+vector<vector<uint8_t>> multires_v2_reader::read_levels(const size_t last_level) {
+	if (last_level < 1 || last_level > 7)
+		throw invalid_argument("Level not allowed.");
+
+	vector<vector<uint8_t>> levels(last_level);
+	for (size_t l = 0; l < last_level; ++l)
+		levels[l] = read_block(l + 1);
+
+	vector<thread> threads;
+	vector<string> errors(last_level);
+	for (size_t l = 0; l < last_level; ++l)
+		threads.emplace_back([&, l]() {
+			try {
+				levels[l] = decompress_level(levels[l], level_rows(l + 1, height_), level_columns(l + 1, width_));
+			}
+			catch (const exception& e) {
+				errors[l] = e.what();
+			}
+		});
+	for (auto& t : threads)
+		t.join();
+	for (const auto& e : errors)
+		if (!e.empty())
+			throw runtime_error(e);
+
+	return levels;
+}
+
+
 /****************************************************************************************/
\ No newline at end of file
@@ -3,17 +3,42 @@
 
 #include "core.h"
 #include <array>
+#include <istream>
+#include <ostream>
+#include <string>
 #include <stdexcept>
 
 namespace multires {
 
+	// Adam7 pass as a sub-lattice of the image: first row and column and steps between the samples
+	struct adam7_pass {
+		size_t row, column, row_step, column_step;
+	};
+
 	class _multires_base {
 	protected:
 
 		const static core::mat<size_t> adam7_mat;
+		const static std::array<adam7_pass, 7> adam7_passes;
 
 	public:
 
+		// Rows and columns of the lattice of a level (from 1 to 7) in an image of the given size
+		static size_t level_rows(const size_t level, const size_t height) {
+			const adam7_pass& p = adam7_passes[level - 1];
+			return height > p.row ? (height - p.row + p.row_step - 1) / p.row_step : 0;
+		}
+
+		static size_t level_columns(const size_t level, const size_t width) {
+			const adam7_pass& p = adam7_passes[level - 1];
+			return width > p.column ? (width - p.column + p.column_step - 1) / p.column_step : 0;
+		}
+
+		// Number of samples of a level in an image of the given size
+		static size_t level_size(const size_t level, const size_t height, const size_t width) {
+			return level_rows(level, height) * level_columns(level, width);
+		}
+
 		virtual ~_multires_base() = default;
 	};
 
@@ -26,9 +51,17 @@ namespace multires {
 
 		std::vector<uint8_t>& get(const size_t index) const;
 
+		// Copies the samples of a level in one row of the image, every column_step columns from column
+		static void gather_row(const uint8_t* row, const size_t column, const size_t column_step, const size_t width,
+							   uint8_t* out);
+
 	public:
 		explicit multires_encoder(const core::mat<uint8_t>& image);
 
+		// Writes the levels of the image to the stream, in the same order as the encoder stores them, without
+		// keeping them in memory
+		static bool write_levels(std::ostream& os, const core::mat<uint8_t>& image);
+
 		std::vector<uint8_t>& operator[](const size_t index);
 
 		const std::vector<uint8_t>& operator[](const size_t index) const;
@@ -111,6 +144,138 @@ namespace multires {
 		}
 	};
 
+
+	// Refines a single image level after level: the samples of a new level are written in place and each one
+	// is replicated over the block it covers at that level. The blocks of the older samples are already
+	// filled, so only about half of the image is written for each level after the first one.
+	class multires_progressive_decoder: public _multires_base {
+	private:
+
+		size_t level_;
+		core::mat<uint8_t> image_;
+
+	public:
+		multires_progressive_decoder(const size_t height, const size_t width): level_(0), image_(height, width) {}
+
+		size_t level() const {
+			return level_;
+		}
+
+		size_t next_level_size() const {
+			return level_size(level_ + 1, image_.height(), image_.width());
+		}
+
+		// Adds the next level, whose samples are in the order written by the encoder
+		void refine(const uint8_t* samples);
+
+		const core::mat<uint8_t>& image() const {
+			return image_;
+		}
+	};
+
+
+	// Decodes a .mlt file given in pieces of any size, for example as they arrive from a pipe. A level is
+	// decoded as soon as all its bytes have arrived, and the image refined up to it is passed to a callback,
+	// so the first preview needs only about 1/64 of the data.
+	class multires_stream_decoder {
+	private:
+
+		static const size_t header_size = 8 + 2 * sizeof(size_t);
+
+		bool header_read_;
+		std::vector<uint8_t> pending_;
+		multires_progressive_decoder decoder_;
+
+		void read_header();
+
+	public:
+		multires_stream_decoder(): header_read_(false), decoder_(0, 0) {}
+
+		size_t level() const {
+			return decoder_.level();
+		}
+
+		bool complete() const {
+			return header_read_ && decoder_.level() == 7;
+		}
+
+		// Adds the next size bytes of the file and calls on_level(level, image) for every level completed by them
+		template<typename _Callback>
+		void feed(const uint8_t* data, const size_t size, _Callback on_level) {
+			pending_.insert(std::end(pending_), data, data + size);
+			if (!header_read_) {
+				if (pending_.size() < header_size)
+					return;
+				read_header();
+			}
+
+			size_t used = 0;
+			while (decoder_.level() < 7 && pending_.size() - used >= decoder_.next_level_size()) {
+				const size_t level_size = decoder_.next_level_size();
+				decoder_.refine(pending_.data() + used);
+				used += level_size;
+				on_level(decoder_.level(), decoder_.image());
+			}
+			pending_.erase(std::begin(pending_), std::begin(pending_) + used);
+		}
+	};
+
+
+	// Version 2 of the .mlt file: after the magic MULTIRV2 come the width and the height (32 bit) and the
+	// offsets from the start of the file of the 7 levels and of the end of the file (64 bit), all little
+	// endian. Every level is compressed on its own, so it can be read without the others: the rows of its
+	// lattice are filtered as in PNG and the result is Huffman coded, or stored if coding does not make it smaller.
+	class multires_v2: public _multires_base {
+	private:
+
+		enum class level_mode : uint8_t { stored, huffman };
+
+		static void filter_rows(const uint8_t* samples, const size_t rows, const size_t columns, std::vector<uint8_t>& out);
+		static void unfilter_rows(const uint8_t* filtered, const size_t rows, const size_t columns, uint8_t* samples);
+
+	public:
+
+		static const std::string magic;
+		static const size_t header_size = 8 + 2 * 4 + 8 * 8;
+
+		static std::vector<uint8_t> compress_level(const std::vector<uint8_t>& samples, const size_t rows,
+												   const size_t columns);
+		static std::vector<uint8_t> decompress_level(const std::vector<uint8_t>& block, const size_t rows,
+													 const size_t columns);
+
+		// Compresses the levels of the image in parallel and writes the file
+		static bool write(std::ostream& os, const core::mat<uint8_t>& image);
+	};
+
+
+	class multires_v2_reader: public multires_v2 {
+	private:
+
+		std::istream& is_;
+		size_t height_, width_;
+		std::array<uint64_t, 8> offsets_;
+
+		std::vector<uint8_t> read_block(const size_t level);
+
+	public:
+		// Reads the header and the offset table
+		explicit multires_v2_reader(std::istream& is);
+
+		size_t height() const {
+			return height_;
+		}
+
+		size_t width() const {
+			return width_;
+		}
+
+		// Samples of a level, reading only its bytes
+		std::vector<uint8_t> read_level(const size_t level);
+
+		// Samples of the levels from 1 to last_level, which are read in order and decompressed in parallel
+		std::vector<std::vector<uint8_t>> read_levels(const size_t last_level);
+	};
+
 }
 
 #endif // MULTIRES_H
\ No newline at end of file
@@ -5,6 +5,7 @@
 #include <iterator>
 #include <array>
 #include <cstdint>
+#include <algorithm>
 
 namespace core {
 
@@ -65,6 +66,67 @@ namespace core {
 	};
 
 
+	// Horizontal band of an image of size height x width holding the rows [first_row, last_row).
+	// Pixels are addressed with the row index of the whole image.
+	template<typename T>
+	class band {
+	public:
+		explicit band(size_t height = 0, size_t width = 0) : height_(height), width_(width), first_row_(0), rows_(0) {}
+
+		size_t height() const {
+			return height_;
+		}
+
+		size_t width() const {
+			return width_;
+		}
+
+		size_t first_row() const {
+			return first_row_;
+		}
+
+		size_t last_row() const {
+			return first_row_ + rows_;
+		}
+
+		// Appends count rows copied from rows
+		void append(const T* rows, size_t count) {
+			data_.insert(data_.end(), rows, rows + count * width_);
+			rows_ += count;
+		}
+
+		// Appends default constructed rows up to row
+		void extend_to(size_t row) {
+			if (row > last_row()) {
+				rows_ = row - first_row_;
+				data_.resize(rows_ * width_);
+			}
+		}
+
+		// Drops the rows before row
+		void drop_before(size_t row) {
+			if (row <= first_row_)
+				return;
+			size_t count = std::min(row, last_row()) - first_row_;
+			data_.erase(data_.begin(), data_.begin() + count * width_);
+			first_row_ += count;
+			rows_ -= count;
+		}
+
+		T& operator()(size_t row, size_t column) {
+			return data_[(row - first_row_) * width_ + column];
+		}
+
+		const T& operator()(size_t row, size_t column) const {
+			return data_[(row - first_row_) * width_ + column];
+		}
+
+	private:
+		size_t height_, width_;
+		size_t first_row_, rows_;
+		std::vector<T> data_;
+	};
+
 	template<typename T, size_t N>
 	class vec {
 	public:
@@ -96,6 +158,7 @@ namespace core {
 	};
 
 	typedef vec<uint8_t, 3> vec3b;
+	typedef vec<uint16_t, 3> vec3w;
 }
 
 #endif // CORE_H
\ No newline at end of file
@@ -7,7 +7,14 @@
 #include <cstdint>
 #include <cstdlib>
 #include <algorithm>
-#include <tuple>
+#include <thread>
+#include <vector>
+#include <limits>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <chrono>
+#include <cmath>
 
 using namespace std;
 using namespace core;
@@ -15,7 +22,12 @@ using namespace pgm;
 using namespace ppm;
 
 void syntax() {
-	cerr << "Usage: bayer_decode <input_file>.pgm <output_prefix>";
+	cerr << "Usage: bayer_decode [--archive] [--stripe <rows>] [--algo <name>] <input_file>.pgm <output_prefix>\n";
+	cerr << "       bayer_decode --bench <input_file>.pgm\n";
+	cerr << "  --archive        also write the 16 bit RGB image to <output_prefix>_16.ppm\n";
+	cerr << "  --stripe <rows>  stream the image in stripes of <rows> rows (binary pgm only)\n";
+	cerr << "  --algo <name>    demosaic algorithm: gradient (default), bilinear or mhc\n";
+	cerr << "  --bench          time every algorithm and compare it with gradient\n";
 	exit(EXIT_FAILURE);
 }
 
@@ -28,12 +40,22 @@ inline bool check_extension(const string& filename, string extension) {
 	return filename.substr(filename.size() - extension.size()) == extension;
 }
 
-inline uint8_t saturate(double val) {
-	return val < 0. ? 0ui8 : val > 255. ? 255ui8 : uint8_t(val);
+template<typename T>
+inline T saturate(double val) {
+	const double max_val = numeric_limits<T>::max();
+	return val < 0. ? T(0) : val > max_val ? numeric_limits<T>::max() : T(val);
 }
 
 inline uint8_t scale_down(uint16_t val) {
-	return saturate(val / 65535. * 255.);
+	return saturate<uint8_t>(val / 65535. * 255.);
+}
+
+// Tone curve from 16 to 8 bits, evaluated once for every possible sample
+inline vector<uint8_t> tone_lut() {
+	vector<uint8_t> lut(65536);
+	for (size_t i = 0; i < lut.size(); ++i)
+		lut[i] = scale_down(uint16_t(i));
+	return lut;
 }
 
 inline void write_intermediate_image(const string& output_prefix, const mat<uint8_t>& img) {
@@ -44,8 +66,9 @@ inline void write_intermediate_image(const string& output_prefix, const mat<uint
 		error("Cannot save the intermediate image.");
 }
 
-inline pair<uint8_t, uint8_t> mean(const mat<vec3b>& img, size_t r, size_t c, size_t v_index, size_t h_index) {
-	uint8_t v_mean;
+template<template<typename> class I, typename T>
+inline pair<T, T> mean(const I<vec<T, 3>>& img, size_t r, size_t c, size_t v_index, size_t h_index) {
+	T v_mean;
 	if (r == 0)
 		v_mean = img(r + 1, c)[v_index];
 	else
@@ -54,7 +77,7 @@ inline pair<uint8_t, uint8_t> mean(const mat<vec3b>& img, size_t r, size_t c, si
 		else
 			v_mean = round((double(img(r - 1, c)[v_index]) + img(r + 1, c)[v_index]) / 2.);
 	
-	uint8_t h_mean;
+	T h_mean;
 	if (c == 0)
 		h_mean = img(r, c + 1)[h_index];
 	else
@@ -66,24 +89,65 @@ inline pair<uint8_t, uint8_t> mean(const mat<vec3b>& img, size_t r, size_t c, si
 	return make_pair(v_mean, h_mean);
 }
 
-inline tuple<uint16_t, double, double> delta_h(const mat<uint8_t>& img, size_t r, size_t c) {
-	int16_t g4 = img(r, c - 1), g6 = img(r, c + 1);
-	int16_t x5 = img(r, c), x3 = img(r, c - 2), x7 = img(r, c + 2);
-
-	uint16_t delta = abs(g4 - g6) + abs(2 * x5 - x3 - x7);
-	return make_tuple(delta, (g4 + g6) / 2., (2 * x5 - x3 - x7) / 4.);
+// Gradient corrected interpolation shared by the green and the red/blue passes. Both candidate values are
+// passed multiplied by 4 (they are exact multiples of 1/4), so the smaller gradient wins with an exact
+// integer and a tie averages the two candidates in eighths, exactly as the double formulation did.
+template<typename T>
+inline T clamp_sample(int32_t val) {
+	return T(val < 0 ? 0 : val > numeric_limits<T>::max() ? numeric_limits<T>::max() : val);
 }
 
-inline tuple<uint16_t, double, double> delta_v(const mat<uint8_t>& img, size_t r, size_t c) {
-	int16_t g2 = img(r - 1, c), g8 = img(r + 1, c);
-	int16_t x5 = img(r, c), x1 = img(r - 2, c), x9 = img(r + 2, c);
+template<typename T>
+inline T gradient_select(int32_t delta_a, int32_t value_a, int32_t delta_b, int32_t value_b) {
+	int32_t v = delta_a > delta_b ? value_b * 2 : delta_a < delta_b ? value_a * 2 : value_a + value_b;
+	return clamp_sample<T>(v >> 3);
+}
 
-	uint16_t delta = abs(g2 - g8) + abs(2 * x5 - x1 - x9);
-	return make_tuple(delta, (g2 + g8) / 2., (2 * x5 - x1 - x9) / 4.);
+// Runs f(r) for every row in [first, last), splitting the rows in one band per thread.
+template<typename F>
+void parallel_rows(size_t first, size_t last, F f) {
+	if (first >= last)
+		return;
+	size_t n_threads = min<size_t>(max(1u, thread::hardware_concurrency()), last - first);
+	size_t band = (last - first + n_threads - 1) / n_threads;
+	vector<thread> workers;
+	for (size_t t = 0; t < n_threads; ++t) {
+		size_t band_first = first + t * band;
+		size_t band_last = min(last, band_first + band);
+		workers.emplace_back([=, &f]() {
+			for (size_t r = band_first; r < band_last; ++r)
+				f(r);
+		});
+	}
+	for (auto& w : workers)
+		w.join();
 }
 
+// Green at the red and blue sites of a row with two valid rows and columns on every side. The loop has
+// no branches, so it is vectorised across the columns.
+template<template<typename> class I, typename T>
+inline void green_kernel(const I<T>& img, size_t r, vector<T>& out) {
+	const T* up2 = &img(r - 2, 0);
+	const T* up1 = &img(r - 1, 0);
+	const T* cur = &img(r, 0);
+	const T* dn1 = &img(r + 1, 0);
+	const T* dn2 = &img(r + 2, 0);
+	T* dst = out.data();
+
+	for (size_t c = 2; c < img.width() - 2; ++c) {
+		int32_t x5 = cur[c];
+		int32_t g4 = cur[c - 1], g6 = cur[c + 1], x3 = cur[c - 2], x7 = cur[c + 2];
+		int32_t g2 = up1[c], g8 = dn1[c], x1 = up2[c], x9 = dn2[c];
+
+		int32_t dh = abs(g4 - g6) + abs(2 * x5 - x3 - x7);
+		int32_t dv = abs(g2 - g8) + abs(2 * x5 - x1 - x9);
+		dst[c] = gradient_select<T>(dh, 2 * (g4 + g6) + 2 * x5 - x3 - x7, dv, 2 * (g2 + g8) + 2 * x5 - x1 - x9);
+	}
+}
 
-inline uint8_t green_interpolation(const mat<uint8_t>& img, size_t r, size_t c) {
+// Border pixels only: the interior is handled by green_kernel.
+template<template<typename> class I, typename T>
+inline T green_interpolation(const I<T>& img, size_t r, size_t c) {
 	if (r == 0) {
 		if (c == 0)
 			return img(r, c + 1);
@@ -91,19 +155,19 @@ inline uint8_t green_interpolation(const mat<uint8_t>& img, size_t r, size_t c)
 			if (c == img.width() - 1)
 				return img(r, c - 1);
 			else
-				return saturate((double(img(r, c - 1)) + img(r, c + 1)) / 2.);
+				return saturate<T>((double(img(r, c - 1)) + img(r, c + 1)) / 2.);
 	}
 
 	if (r == 1) {
 		if (c == img.width() - 1)
-			return saturate((double(img(r - 1, c)) + img(r + 1, c)) / 2.);
+			return saturate<T>((double(img(r - 1, c)) + img(r + 1, c)) / 2.);
 		else {
 			double v_mean = ((double(img(r - 1, c)) + img(r + 1, c)) / 2.);
 			double h_mean = ((double(img(r + 1, c)) + img(r + 1, c)) / 2.);
 			if (v_mean >= h_mean)
-				return saturate(h_mean);
+				return saturate<T>(h_mean);
 			else
-				return saturate(v_mean);
+				return saturate<T>(v_mean);
 		}
 	}
 
@@ -111,25 +175,25 @@ inline uint8_t green_interpolation(const mat<uint8_t>& img, size_t r, size_t c)
 	if (r == img.height() - 2) {
 		if (r % 2 == 0)
 			if (c == 0 || c == img.width() - 1)
-				return saturate((double(img(r + 1, c)) + img(r - 1, c)) / 2.);
+				return saturate<T>((double(img(r + 1, c)) + img(r - 1, c)) / 2.);
 			else {
 				double v_mean = ((double(img(r + 1, c)) + img(r - 1, c)) / 2.);
 				double h_mean = ((double(img(r, c + 1)) + img(r, c - 1)) / 2.);
 				if (v_mean >= h_mean)
-					return saturate(h_mean);
+					return saturate<T>(h_mean);
 				else
-					return saturate(v_mean);
+					return saturate<T>(v_mean);
 			}
 		else
 			if (c == img.width() - 1)
-				return saturate((double(img(r - 1, c)) + img(r + 1, c)) / 2.);
+				return saturate<T>((double(img(r - 1, c)) + img(r + 1, c)) / 2.);
 			else {
 				double v_mean = ((double(img(r - 1, c)) + img(r + 1, c)) / 2.);
 				double h_mean = ((double(img(r + 1, c)) + img(r + 1, c)) / 2.);
 				if (v_mean >= h_mean)
-					return saturate(h_mean);
+					return saturate<T>(h_mean);
 				else
-					return saturate(v_mean);
+					return saturate<T>(v_mean);
 			}
 	}
 
@@ -141,67 +205,80 @@ inline uint8_t green_interpolation(const mat<uint8_t>& img, size_t r, size_t c)
 				if (c == img.width() - 1)
 					return img(r, c - 1);
 				else
-					return saturate((double(img(r, c - 1)) + img(r, c + 1)) / 2.);
+					return saturate<T>((double(img(r, c - 1)) + img(r, c + 1)) / 2.);
 		else
-			if (c == img.width())
+			if (c == img.width() - 1)
 				return img(r, c - 1);
 			else
-				return saturate((double(img(r, c - 1)) + img(r, c + 1)) / 2.);
+				return saturate<T>((double(img(r, c - 1)) + img(r, c + 1)) / 2.);
 	}
 
-	if (c < 2 || c >= img.width() - 2)
-		return saturate((double(img(r - 1, c)) + img(r + 1, c)) / 2.);
-
-	const auto dh = delta_h(img, r, c);
-	const auto dv = delta_v(img, r, c);
-
-	if (get<0>(dh) > get<0>(dv))
-		return saturate(get<1>(dv) + get<2>(dv));
-	else
-		if (get<0>(dh) < get<0>(dv))
-			return saturate(get<1>(dh) + get<2>(dh));
-		else
-			return saturate(((get<1>(dv) + get<1>(dh)) / 2.) + ((get<2>(dh) + get<2>(dv)) / 2.));
+	return saturate<T>((double(img(r - 1, c)) + img(r + 1, c)) / 2.);
 }
 
-inline mat<vec3b>& scan_and_rebuild_green(const mat<uint8_t>& bayer_img, mat<vec3b>& img) {
-	img.resize(bayer_img.height(), bayer_img.width());
+inline bool is_interior(size_t r, size_t size) {
+	return r >= 2 && r + 2 < size;
+}
 
-	for (size_t r = 0; r < img.height(); ++r) {
-		for (size_t c = 0; c < img.width(); ++c) {
-			if (r % 2 == 0 && c % 2 == 0)
-				img(r, c)[0] = bayer_img(r, c);
-			if (r % 2 == 1 && c % 2 == 1)
-				img(r, c)[2] = bayer_img(r, c);
-			if ((r % 2 == 0 && c % 2 == 1) || (r % 2 == 1 && c % 2 == 0))
-				img(r, c)[1] = bayer_img(r, c);
-			else
-				img(r, c)[1] = green_interpolation(bayer_img, r, c);
-		}
+template<template<typename> class I, typename T>
+inline void rebuild_green_row(const I<T>& bayer_img, I<vec<T, 3>>& img, size_t r, vector<T>& buffer) {
+	bool interior_row = is_interior(r, img.height());
+	if (interior_row)
+		green_kernel(bayer_img, r, buffer);
+
+	for (size_t c = 0; c < img.width(); ++c) {
+		if (r % 2 == 0 && c % 2 == 0)
+			img(r, c)[0] = bayer_img(r, c);
+		if (r % 2 == 1 && c % 2 == 1)
+			img(r, c)[2] = bayer_img(r, c);
+		if ((r % 2 == 0 && c % 2 == 1) || (r % 2 == 1 && c % 2 == 0))
+			img(r, c)[1] = bayer_img(r, c);
+		else
+			img(r, c)[1] = interior_row && is_interior(c, img.width()) ? buffer[c] : green_interpolation(bayer_img, r, c);
 	}
-
-	return img;
 }
 
-
-
-inline tuple<uint16_t, double, double> delta_n(const mat<vec3b>& img, size_t r, size_t c, size_t color_index) {
-	int16_t g1 = img(r - 1, c - 1)[1], g9 = img(r + 1, c + 1)[1], g5 = img(r, c)[1];
-	int16_t x1 = img(r - 1, c - 1)[color_index], x9 = img(r + 1, c + 1)[color_index];
-
-	uint16_t delta = abs(x1 - x9) + abs(2 * g5 - g1 - g9);
-	return make_tuple(delta, (x1 + x9) / 2., (2 * g5 - g1 - g9) / 4.);
+template<template<typename> class I, typename T>
+inline void rebuild_green_rows(const I<T>& bayer_img, I<vec<T, 3>>& img, size_t first, size_t last) {
+	// Green interpolation only reads the mosaic, so every row is independent
+	parallel_rows(first, last, [&](size_t r) {
+		thread_local vector<T> buffer;
+		buffer.resize(img.width());
+		rebuild_green_row(bayer_img, img, r, buffer);
+	});
 }
 
-inline tuple<uint16_t, double, double> delta_p(const mat<vec3b>& img, size_t r, size_t c, size_t color_index) {
-	int16_t g3 = img(r - 1, c + 1)[1], g5 = img(r, c)[1], g7 = img(r + 1, c - 1)[1];
-	int16_t x3 = img(r - 1, c + 1)[color_index], x7 = img(r + 1, c - 1)[color_index];
+template<typename T>
+inline mat<vec<T, 3>>& scan_and_rebuild_green(const mat<T>& bayer_img, mat<vec<T, 3>>& img) {
+	img.resize(bayer_img.height(), bayer_img.width());
+	rebuild_green_rows(bayer_img, img, 0, img.height());
+	return img;
+}
 
-	uint16_t delta = abs(x3 - x7) + abs(2 * g5 - g3 - g7);
-	return make_tuple(delta, (x3 + x7) / 2., (2 * g5 - g3 - g7) / 4.);
+// Red at the blue sites or blue at the red sites of an interior row: color_index is the missing channel,
+// which lies on the diagonal neighbours. Only the columns of the same parity as the row are visited, since
+// the green sites of the neighbouring rows are written concurrently by the other bands.
+template<template<typename> class I, typename T>
+inline void x_kernel(const I<vec<T, 3>>& img, size_t r, size_t color_index, vector<T>& out) {
+	const vec<T, 3>* up = &img(r - 1, 0);
+	const vec<T, 3>* cur = &img(r, 0);
+	const vec<T, 3>* dn = &img(r + 1, 0);
+	T* dst = out.data();
+
+	for (size_t c = 2 + r % 2; c < img.width() - 2; c += 2) {
+		int32_t g5 = cur[c][1];
+		int32_t g1 = up[c - 1][1], g9 = dn[c + 1][1], x1 = up[c - 1][color_index], x9 = dn[c + 1][color_index];
+		int32_t g3 = up[c + 1][1], g7 = dn[c - 1][1], x3 = up[c + 1][color_index], x7 = dn[c - 1][color_index];
+
+		int32_t dn_ = abs(x1 - x9) + abs(2 * g5 - g1 - g9);
+		int32_t dp = abs(x3 - x7) + abs(2 * g5 - g3 - g7);
+		dst[c] = gradient_select<T>(dn_, 2 * (x1 + x9) + 2 * g5 - g1 - g9, dp, 2 * (x3 + x7) + 2 * g5 - g3 - g7);
+	}
 }
 
-inline uint8_t x_interpolation(const mat<vec3b>& img, size_t r, size_t c) {
+// Border pixels only: the interior is handled by x_kernel.
+template<template<typename> class I, typename T>
+inline T x_interpolation(const I<vec<T, 3>>& img, size_t r, size_t c) {
 	size_t color_index;
 	if (r % 2 == 0)
 		color_index = 2;
@@ -216,13 +293,13 @@ inline uint8_t x_interpolation(const mat<vec3b>& img, size_t r, size_t c) {
 	}
 
 	if (r == 1) {
-		if (c != img.width()) {
+		if (c != img.width() - 1) {
 			double p_mean = (double(img(r - 1, c - 1)[0]) + img(r + 1, c + 1)[0]) / 2.;
 			double n_mean = (double(img(r - 1, c + 1)[0]) + img(r + 1, c - 1)[0]) / 2.;
 			if (p_mean >= n_mean)
-				return saturate(n_mean);
+				return saturate<T>(n_mean);
 			else
-				return saturate(p_mean);
+				return saturate<T>(p_mean);
 		}
 		else
 			return img(r - 1, c - 1)[0];
@@ -230,13 +307,13 @@ inline uint8_t x_interpolation(const mat<vec3b>& img, size_t r, size_t c) {
 
 	if (r == img.height() - 2) {
 		if (color_index == 0) {
-			if (c != img.width()) {
+			if (c != img.width() - 1) {
 				double p_mean = (double(img(r - 1, c - 1)[0]) + img(r + 1, c + 1)[0]) / 2.;
 				double n_mean = (double(img(r - 1, c + 1)[0]) + img(r + 1, c - 1)[0]) / 2.;
 				if (p_mean >= n_mean)
-					return saturate(n_mean);
+					return saturate<T>(n_mean);
 				else
-					return saturate(p_mean);
+					return saturate<T>(p_mean);
 			}
 			else
 				return img(r - 1, c - 1)[0];
@@ -251,9 +328,9 @@ inline uint8_t x_interpolation(const mat<vec3b>& img, size_t r, size_t c) {
 					double p_mean = (double(img(r - 1, c - 1)[0]) + img(r + 1, c + 1)[0]) / 2.;
 					double n_mean = (double(img(r - 1, c + 1)[0]) + img(r + 1, c - 1)[0]) / 2.;
 					if (p_mean >= n_mean)
-						return saturate(n_mean);
+						return saturate<T>(n_mean);
 					else
-						return saturate(p_mean);
+						return saturate<T>(p_mean);
 				}
 		}
 	}
@@ -279,47 +356,178 @@ inline uint8_t x_interpolation(const mat<vec3b>& img, size_t r, size_t c) {
 	if (c == img.width() - 2)
 		return img(r + 1, c + 1)[color_index];
 
-	if (c == img.width() - 1)
-		return img(r - 1, c - 1)[color_index];
+	return img(r - 1, c - 1)[color_index];
+}
 
-	auto dn = delta_n(img, r, c, color_index);
-	auto dp = delta_p(img, r, c, color_index);
+template<template<typename> class I, typename T>
+inline void rebuild_row_colors(I<vec<T, 3>>& rgb, size_t r, vector<T>& buffer) {
+	bool interior_row = is_interior(r, rgb.height());
+	if (interior_row)
+		x_kernel(rgb, r, r % 2 == 0 ? 2 : 0, buffer);
+
+	for (size_t c = 0; c < rgb.width(); ++c) {
+		if (r % 2 == 0 && c % 2 == 1) {
+			auto p = mean(rgb, r, c, 2, 0);
+			vec<T, 3>& pixel = rgb(r, c);
+			pixel[2] = p.first;
+			pixel[0] = p.second;
+		}
+		if (r % 2 == 1 && c % 2 == 0) {
+			auto p = mean(rgb, r, c, 0, 2);
+			vec<T, 3>& pixel = rgb(r, c);
+			pixel[0] = p.first;
+			pixel[2] = p.second;
+		}
+		bool kernel = interior_row && is_interior(c, rgb.width());
+		if (r % 2 == 0 && c % 2 == 0)
+			rgb(r, c)[2] = kernel ? buffer[c] : x_interpolation(rgb, r, c);
+		if (r % 2 == 1 && c % 2 == 1)
+			rgb(r, c)[0] = kernel ? buffer[c] : x_interpolation(rgb, r, c);
+	}
+}
 
-	if (get<0>(dn) > get<0>(dp))
-		return saturate(get<1>(dp) + get<2>(dp));
-	else
-		if (get<0>(dn) < get<0>(dp))
-			return saturate(get<1>(dn) + get<2>(dn));
-		else
-			return saturate(((get<1>(dn) + get<1>(dp)) / 2.) + ((get<2>(dn) + get<2>(dp)) / 2.));
+template<template<typename> class I, typename T>
+inline void rebuild_colors_rows(I<vec<T, 3>>& rgb, size_t first, size_t last) {
+	// Interior rows only read the samples of the mosaic and the green plane, so they can run in parallel.
+	// The border rows read values written by the previous rows, so they keep the raster order.
+	size_t interior_first = min(max<size_t>(first, 2), last);
+	size_t interior_last = max(interior_first, min(last, rgb.height() < 2 ? 0 : rgb.height() - 2));
+	vector<T> buffer(rgb.width());
+	for (size_t r = first; r < interior_first; ++r)
+		rebuild_row_colors(rgb, r, buffer);
+	parallel_rows(interior_first, interior_last, [&](size_t r) {
+		thread_local vector<T> band_buffer;
+		band_buffer.resize(rgb.width());
+		rebuild_row_colors(rgb, r, band_buffer);
+	});
+	for (size_t r = interior_last; r < last; ++r)
+		rebuild_row_colors(rgb, r, buffer);
 }
 
-inline mat<vec3b>& rebuild_missing_colors(mat<vec3b>& rgb) {
-	for (size_t r = 0; r < rgb.height(); ++r) {
-		for (size_t c = 0; c < rgb.width(); ++c) {
-			if (r % 2 == 0 && c % 2 == 1) {
-				auto p = mean(rgb, r, c, 2, 0);
-				vec3b& pixel = rgb(r, c);
-				pixel[2] = p.first;
-				pixel[0] = p.second;
-			}
-			if (r % 2 == 1 && c % 2 == 0) {
-				auto p = mean(rgb, r, c, 0, 2);
-				vec3b& pixel = rgb(r, c);
-				pixel[0] = p.first;
-				pixel[2] = p.second;
-			}
-			if (r % 2 == 0 && c % 2 == 0)
-				rgb(r, c)[2] = x_interpolation(rgb, r, c);
-			if (r % 2 == 1 && c % 2 == 1)
-				rgb(r, c)[0] = x_interpolation(rgb, r, c);
+template<typename T>
+inline mat<vec<T, 3>>& rebuild_missing_colors(mat<vec<T, 3>>& rgb) {
+	rebuild_colors_rows(rgb, 0, rgb.height());
+	return rgb;
+}
+
+enum class demosaic_algo { gradient, bilinear, mhc };
+
+const char* const algo_names[] = { "gradient", "bilinear", "mhc" };
+
+inline bool parse_algo(const string& name, demosaic_algo& algo) {
+	for (size_t i = 0; i < 3; ++i)
+		if (name == algo_names[i]) {
+			algo = demosaic_algo(i);
+			return true;
 		}
+	return false;
+}
+
+// Reflection of an index into [0, size) that does not repeat the border sample, so the Bayer parity is kept
+inline size_t mirror(ptrdiff_t i, size_t size) {
+	return i < 0 ? size_t(-i) : size_t(i) >= size ? 2 * (size - 1) - size_t(i) : size_t(i);
+}
+
+// w holds the five mosaic rows from r - 2 to r + 2, padded so that columns -2 and width + 1 are valid.
+// In a row the red (or blue) sites have the same parity of the row and the green sites the other one.
+template<typename T>
+inline void bilinear_row(const T* const* w, size_t r, size_t width, vec<T, 3>* out) {
+	const T* u1 = w[1];
+	const T* x = w[2];
+	const T* d1 = w[3];
+	const size_t own = r % 2 == 0 ? 0 : 2;
+	const size_t other = 2 - own;
+
+	for (size_t c = r % 2; c < width; c += 2) {
+		out[c][own] = x[c];
+		out[c][1] = T((u1[c] + d1[c] + x[c - 1] + x[c + 1] + 2) >> 2);
+		out[c][other] = T((u1[c - 1] + u1[c + 1] + d1[c - 1] + d1[c + 1] + 2) >> 2);
 	}
+	for (size_t c = 1 - r % 2; c < width; c += 2) {
+		out[c][1] = x[c];
+		out[c][own] = T((x[c - 1] + x[c + 1] + 1) >> 1);
+		out[c][other] = T((u1[c] + d1[c] + 1) >> 1);
+	}
+}
 
+// Malvar-He-Cutler 5x5 filters, with the coefficients in sixteenths
+template<typename T>
+inline void mhc_row(const T* const* w, size_t r, size_t width, vec<T, 3>* out) {
+	const T* u2 = w[0];
+	const T* u1 = w[1];
+	const T* x = w[2];
+	const T* d1 = w[3];
+	const T* d2 = w[4];
+	const size_t own = r % 2 == 0 ? 0 : 2;
+	const size_t other = 2 - own;
+
+	for (size_t c = r % 2; c < width; c += 2) {
+		int32_t center = x[c];
+		int32_t cross = u1[c] + d1[c] + x[c - 1] + x[c + 1];
+		int32_t diagonal = u1[c - 1] + u1[c + 1] + d1[c - 1] + d1[c + 1];
+		int32_t far = u2[c] + d2[c] + x[c - 2] + x[c + 2];
+		out[c][own] = x[c];
+		out[c][1] = clamp_sample<T>((8 * center + 4 * cross - 2 * far + 8) >> 4);
+		out[c][other] = clamp_sample<T>((12 * center + 4 * diagonal - 3 * far + 8) >> 4);
+	}
+	for (size_t c = 1 - r % 2; c < width; c += 2) {
+		int32_t center = x[c];
+		int32_t diagonal = u1[c - 1] + u1[c + 1] + d1[c - 1] + d1[c + 1];
+		int32_t far_h = x[c - 2] + x[c + 2];
+		int32_t far_v = u2[c] + d2[c];
+		out[c][1] = x[c];
+		out[c][own] = clamp_sample<T>((10 * center + 8 * (x[c - 1] + x[c + 1]) - 2 * far_h - 2 * diagonal + far_v + 8) >> 4);
+		out[c][other] = clamp_sample<T>((10 * center + 8 * (u1[c] + d1[c]) - 2 * far_v - 2 * diagonal + far_h + 8) >> 4);
+	}
+}
+
+// Bilinear or Malvar-He-Cutler demosaic of the rows [first, last). Every row is computed from a copy of the
+// five mosaic rows around it, mirrored by two samples at the borders, so the column loops have no border
+// cases and are vectorised. The image must be at least 3x3.
+template<template<typename> class I, typename T>
+inline void demosaic_linear_rows(const I<T>& bayer_img, I<vec<T, 3>>& rgb, size_t first, size_t last, demosaic_algo algo) {
+	const size_t width = rgb.width();
+	parallel_rows(first, last, [&](size_t r) {
+		thread_local vector<T> padded;
+		padded.resize(5 * (width + 4));
+		const T* window[5];
+		for (size_t k = 0; k < 5; ++k) {
+			const T* src = &bayer_img(mirror(ptrdiff_t(r + k) - 2, rgb.height()), 0);
+			T* dst = padded.data() + k * (width + 4) + 2;
+			copy(src, src + width, dst);
+			dst[-2] = src[2];
+			dst[-1] = src[1];
+			dst[width] = src[width - 2];
+			dst[width + 1] = src[width - 3];
+			window[k] = dst;
+		}
+
+		if (algo == demosaic_algo::bilinear)
+			bilinear_row(window, r, width, &rgb(r, 0));
+		else
+			mhc_row(window, r, width, &rgb(r, 0));
+	});
+}
+
+template<typename T>
+inline mat<vec<T, 3>>& demosaic(const mat<T>& bayer_img, mat<vec<T, 3>>& rgb, demosaic_algo algo) {
+	if (algo == demosaic_algo::gradient) {
+		scan_and_rebuild_green(bayer_img, rgb);
+		rebuild_missing_colors(rgb);
+	}
+	else {
+		rgb.resize(bayer_img.height(), bayer_img.width());
+		demosaic_linear_rows(bayer_img, rgb, 0, rgb.height(), algo);
+	}
 	return rgb;
 }
 
-void bayer_decode(const string& input_filename, const string& output_prefix) {
+inline void check_size(size_t width, size_t height, demosaic_algo algo) {
+	if (algo != demosaic_algo::gradient && (width < 3 || height < 3))
+		error("The image is too small for the selected algorithm.");
+}
+
+void bayer_decode(const string& input_filename, const string& output_prefix, bool archive, demosaic_algo algo) {
 	if (!check_extension(input_filename, ".pgm"))
 		error("Input file must be a .pgm file.");
 	ifstream is(input_filename, ios::binary);
@@ -328,13 +536,31 @@ void bayer_decode(const string& input_filename, const string& output_prefix) {
 	mat<uint16_t> bit16_img;
 	if (!load_pgm(is, bit16_img))
 		error("Cannot load the input image.");
-	mat<uint8_t> bayer_img(bit16_img.height(), bit16_img.width());
-	transform(begin(bit16_img), end(bit16_img), begin(bayer_img), scale_down);
-	write_intermediate_image(output_prefix, bayer_img);
+	check_size(bit16_img.width(), bit16_img.height(), algo);
+
+	const auto lut = tone_lut();
+	{
+		mat<uint8_t> bayer_img(bit16_img.height(), bit16_img.width());
+		transform(begin(bit16_img), end(bit16_img), begin(bayer_img), [&lut](uint16_t val) { return lut[val]; });
+		write_intermediate_image(output_prefix, bayer_img);
+	}
+
+	// The demosaic works on the full 16 bits, the reduction to 8 bits is the last step
+	mat<vec3w> rgb16;
+	demosaic(bit16_img, rgb16, algo);
+
+	if (archive) {
+		ofstream os(output_prefix + "_16.ppm", ios::binary);
+		if (!os)
+			error("Cannot open the output file for the 16 bit image.");
+		if (!save_ppm(os, rgb16))
+			error("Cannot save the 16 bit image.");
+	}
 
-	mat<vec3b> rgb;
-	scan_and_rebuild_green(bayer_img, rgb);
-	rebuild_missing_colors(rgb);
+	mat<vec3b> rgb(rgb16.height(), rgb16.width());
+	transform(begin(rgb16), end(rgb16), begin(rgb), [&lut](const vec3w& p) {
+		return vec3b(lut[p[0]], lut[p[1]], lut[p[2]]);
+	});
 
 	ofstream os(output_prefix + ".ppm", ios::binary);
 	if (!os)
@@ -343,13 +569,248 @@ void bayer_decode(const string& input_filename, const string& output_prefix) {
 		error("Cannot save the final image.");
 }
 
+// Blocking queue with a maximum number of items, used to connect the stages of the streaming decoder
+template<typename T>
+class bounded_queue {
+public:
+	explicit bounded_queue(size_t capacity) : capacity_(capacity), closed_(false) {}
+
+	void push(T item) {
+		unique_lock<mutex> lock(mutex_);
+		not_full_.wait(lock, [this]() { return items_.size() < capacity_; });
+		items_.push_back(move(item));
+		not_empty_.notify_one();
+	}
+
+	// Returns false when the queue is closed and empty
+	bool pop(T& item) {
+		unique_lock<mutex> lock(mutex_);
+		not_empty_.wait(lock, [this]() { return !items_.empty() || closed_; });
+		if (items_.empty())
+			return false;
+		item = move(items_.front());
+		items_.pop_front();
+		not_full_.notify_one();
+		return true;
+	}
+
+	void close() {
+		lock_guard<mutex> lock(mutex_);
+		closed_ = true;
+		not_empty_.notify_all();
+	}
+
+private:
+	size_t capacity_;
+	bool closed_;
+	deque<T> items_;
+	mutex mutex_;
+	condition_variable not_full_, not_empty_;
+};
+
+struct decoded_stripe {
+	vector<uint8_t> mosaic;
+	vector<vec3b> rgb;
+	vector<vec3w> rgb16;
+};
+
+// Same result as bayer_decode, but the image goes through in horizontal stripes: a reader thread loads the
+// mosaic, the stripes are demosaiced here and a writer thread saves the rows as they are completed.
+// The second pass on row r reads the rows from r - 2 to r + 2 and the green pass on them needs two more
+// rows of mosaic, so every stripe keeps two completed rows above it and four mosaic rows below it.
+void bayer_decode_stream(const string& input_filename, const string& output_prefix, bool archive, size_t stripe_rows,
+							demosaic_algo algo) {
+	if (!check_extension(input_filename, ".pgm"))
+		error("Input file must be a .pgm file.");
+	ifstream is(input_filename, ios::binary);
+	if (!is)
+		error("Cannot open input file.");
+	size_t width, height;
+	uint32_t max_value;
+	if (!load_pgm_header(is, width, height, max_value))
+		error("Cannot load the input image.");
+	check_size(width, height, algo);
+
+	ofstream pgm_os(output_prefix + ".pgm", ios::binary);
+	if (!pgm_os)
+		error("Cannot open the output file for intermediate image.");
+	ofstream os(output_prefix + ".ppm", ios::binary);
+	if (!os)
+		error("Cannot open the output file for final image.");
+	ofstream archive_os;
+	if (archive) {
+		archive_os.open(output_prefix + "_16.ppm", ios::binary);
+		if (!archive_os)
+			error("Cannot open the output file for the 16 bit image.");
+	}
+
+	bounded_queue<vector<uint16_t>> mosaic_queue(2);
+	bounded_queue<decoded_stripe> output_queue(2);
+
+	thread reader([&]() {
+		for (size_t r = 0; r < height; r += stripe_rows) {
+			vector<uint16_t> rows(min(stripe_rows, height - r) * width);
+			if (!load_pgm_samples(is, rows.data(), rows.size()))
+				error("Cannot load the input image.");
+			mosaic_queue.push(move(rows));
+		}
+		mosaic_queue.close();
+	});
+
+	thread writer([&]() {
+		save_pgm_header(pgm_os, width, height, 255);
+		save_ppm_header(os, width, height);
+		if (archive)
+			save_ppm_header(archive_os, width, height, 65535);
+		decoded_stripe stripe;
+		while (output_queue.pop(stripe)) {
+			pgm_os.write(reinterpret_cast<const char*>(stripe.mosaic.data()), stripe.mosaic.size());
+			save_ppm_pixels(os, stripe.rgb.data(), stripe.rgb.size());
+			if (archive)
+				save_ppm_pixels(archive_os, stripe.rgb16.data(), stripe.rgb16.size());
+		}
+		if (!pgm_os)
+			error("Cannot save the intermediate image.");
+		if (!os)
+			error("Cannot save the final image.");
+		if (archive && !archive_os)
+			error("Cannot save the 16 bit image.");
+	});
+
+	const auto lut = tone_lut();
+	band<uint16_t> mosaic(height, width);
+	band<vec3w> rgb(height, width);
+	size_t green_end = 0;
+	for (size_t first = 0; first < height; first += stripe_rows) {
+		size_t last = min(height, first + stripe_rows);
+		while (mosaic.last_row() < min(height, last + 4)) {
+			vector<uint16_t> rows;
+			if (!mosaic_queue.pop(rows))
+				error("Cannot load the input image.");
+			mosaic.append(rows.data(), rows.size() / width);
+		}
+
+		if (algo == demosaic_algo::gradient) {
+			size_t green_last = min(height, last + 2);
+			rgb.drop_before(first < 2 ? 0 : first - 2);
+			rgb.extend_to(green_last);
+			rebuild_green_rows(mosaic, rgb, green_end, green_last);
+			green_end = green_last;
+			rebuild_colors_rows(rgb, first, last);
+		}
+		else {
+			rgb.drop_before(first);
+			rgb.extend_to(last);
+			demosaic_linear_rows(mosaic, rgb, first, last, algo);
+		}
+
+		decoded_stripe stripe;
+		for (size_t r = first; r < last; ++r)
+			for (size_t c = 0; c < width; ++c) {
+				stripe.mosaic.push_back(lut[mosaic(r, c)]);
+				const vec3w& p = rgb(r, c);
+				stripe.rgb.emplace_back(lut[p[0]], lut[p[1]], lut[p[2]]);
+				if (archive)
+					stripe.rgb16.push_back(p);
+			}
+		output_queue.push(move(stripe));
+
+		mosaic.drop_before(last < 2 ? 0 : last - 2);
+	}
+	output_queue.close();
+
+	reader.join();
+	writer.join();
+}
+
+double psnr(const mat<vec3b>& a, const mat<vec3b>& b) {
+	double sum = 0.;
+	for (size_t r = 0; r < a.height(); ++r)
+		for (size_t c = 0; c < a.width(); ++c)
+			for (size_t i = 0; i < 3; ++i) {
+				double d = double(a(r, c)[i]) - b(r, c)[i];
+				sum += d * d;
+			}
+	double mse = sum / (a.height() * a.width() * 3);
+	return 10. * log10(255. * 255. / mse);
+}
+
+// Throughput of every algorithm (best of five runs) and PSNR of its 8 bit output against the gradient one
+void bayer_benchmark(const string& input_filename) {
+	if (!check_extension(input_filename, ".pgm"))
+		error("Input file must be a .pgm file.");
+	ifstream is(input_filename, ios::binary);
+	if (!is)
+		error("Cannot open input file.");
+	mat<uint16_t> bit16_img;
+	if (!load_pgm(is, bit16_img))
+		error("Cannot load the input image.");
+	check_size(bit16_img.width(), bit16_img.height(), demosaic_algo::mhc);
+
+	const auto lut = tone_lut();
+	const double megapixels = bit16_img.height() * bit16_img.width() / 1e6;
+	mat<vec3b> reference;
+	for (size_t i = 0; i < 3; ++i) {
+		demosaic_algo algo = demosaic_algo(i);
+		mat<vec3w> rgb16;
+		double best = numeric_limits<double>::max();
+		for (size_t run = 0; run < 5; ++run) {
+			auto start = chrono::steady_clock::now();
+			demosaic(bit16_img, rgb16, algo);
+			best = min(best, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+		}
+
+		mat<vec3b> rgb(rgb16.height(), rgb16.width());
+		transform(begin(rgb16), end(rgb16), begin(rgb), [&lut](const vec3w& p) {
+			return vec3b(lut[p[0]], lut[p[1]], lut[p[2]]);
+		});
+		if (algo == demosaic_algo::gradient)
+			reference = rgb;
+
+		cout << algo_names[i] << ": " << megapixels / best << " MP/s, PSNR " << psnr(reference, rgb) << " dB\n";
+	}
+}
+
 int main(int argc, char **argv) {
-	if (argc != 3)
-		syntax();
+	bool archive = false, bench = false;
+	size_t stripe_rows = 0;
+	demosaic_algo algo = demosaic_algo::gradient;
+	vector<string> args;
+	for (int i = 1; i < argc; ++i) {
+		string arg(argv[i]);
+		if (arg == "--archive")
+			archive = true;
+		else
+			if (arg == "--bench")
+				bench = true;
+			else
+				if (arg == "--stripe" && i + 1 < argc) {
+					stripe_rows = strtoul(argv[++i], nullptr, 10);
+					if (stripe_rows == 0)
+						syntax();
+				}
+				else
+					if (arg == "--algo" && i + 1 < argc) {
+						if (!parse_algo(argv[++i], algo))
+							syntax();
+					}
+					else
+						args.push_back(arg);
+	}
 
-	string input(argv[1]);
-	string output(argv[2]);
-	bayer_decode(input, output);
+	if (bench) {
+		if (args.size() != 1)
+			syntax();
+		bayer_benchmark(args[0]);
+		return EXIT_SUCCESS;
+	}
+
+	if (args.size() != 2)
+		syntax();
+	if (stripe_rows > 0)
+		bayer_decode_stream(args[0], args[1], archive, stripe_rows, algo);
+	else
+		bayer_decode(args[0], args[1], archive, algo);
 	cout << "Done!!\n";
 
 	return EXIT_SUCCESS;
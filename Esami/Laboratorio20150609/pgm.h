@@ -9,6 +9,40 @@
 
 namespace pgm {
 
+	// Reads the header of a P5 pgm, leaving the stream on the first sample
+	inline bool load_pgm_header(std::istream& is, size_t& width, size_t& height, uint32_t& max_value) {
+		std::string magic;
+		is >> magic;
+		is.get();
+		if (magic != "P5" || !is)
+			return false;
+
+		if (is.peek() == '#') {
+			std::string comment;
+			getline(is, comment);
+		}
+
+		is >> width >> height >> max_value;
+		is.get();
+		return bool(is);
+	}
+
+	// Reads count big endian samples of a P5 pgm
+	template<typename T>
+	bool load_pgm_samples(std::istream& is, T* samples, size_t count) {
+		is.read(reinterpret_cast<char*>(samples), count * sizeof(T));
+		if (sizeof(T) > 1)
+			std::transform(samples, samples + count, samples, [](T val) -> T {
+				T ret = 0;
+				for (size_t i = 0; i < sizeof(T); ++i) {
+					ret = (ret << 8) | (val & 0xFF);
+					val = val >> 8;
+				}
+				return ret;
+			});
+		return bool(is);
+	}
+
 	template<typename T>
 	bool load_pgm(std::istream& is, core::mat<T>& img) {
 		std::string magic;
@@ -32,18 +66,8 @@ namespace pgm {
 			return false;
 
 		img.resize(height, width);
-		if (magic == "P5") {
-			is.read(reinterpret_cast<char*>(img.data()), height*width * sizeof(T));
-			if (sizeof(T) > 1)
-				std::transform(std::begin(img), std::end(img), std::begin(img), [](T val) -> T {
-				T ret = 0;
-				for (size_t i = 0; i < sizeof(T); ++i) {
-					ret = (ret << 8) | (val & 0xFF);
-					val = val >> 8;
-				}
-				return ret;
-			});
-		}
+		if (magic == "P5")
+			load_pgm_samples(is, img.data(), height*width);
 		else
 			if (sizeof(T) == 1)
 				std::copy(std::istream_iterator<uint32_t>(is), std::istream_iterator<uint32_t>(), std::begin(img));
@@ -55,6 +79,11 @@ namespace pgm {
 
 	enum class pgm_type {p2, p5};
 
+	inline bool save_pgm_header(std::ostream& os, size_t width, size_t height, uint32_t max_value) {
+		os << "P5\n" << width << " " << height << "\n" << max_value << "\n";
+		return os.good();
+	}
+
 	template<typename T>
 	bool save_pgm(std::ostream& os, const core::mat<T>& img, pgm_type type = pgm_type::p5, std::string comment = "") {
 		if (type == pgm_type::p5)
@@ -1,5 +1,6 @@
 #include "ppm.h"
 #include <string>
+#include <vector>
 
 using namespace std;
 using namespace core;
@@ -25,6 +26,49 @@ bool ppm::save_ppm(ostream& os, const mat<vec3b>& img, ppm_type type, string com
 	return os.good();
 }
 
+bool ppm::save_ppm(ostream& os, const mat<vec3w>& img, ppm_type type, string comment) {
+	if (type == ppm_type::p6)
+		os << "P6\n";
+	else
+		os << "P3\n";
+
+	if (!comment.empty())
+		os << "# " << comment << "\n";
+
+	os << img.width() << " " << img.height() << "\n65535\n";
+
+	if (type == ppm_type::p6)
+		for (size_t r = 0; r < img.height(); ++r)
+			save_ppm_pixels(os, &img(r, 0), img.width());
+	else
+		for (const auto& pixel : img)
+			os << pixel[0] << " " << pixel[1] << " " << pixel[2] << " ";
+
+	return os.good();
+}
+
+bool ppm::save_ppm_header(ostream& os, size_t width, size_t height, uint32_t max_value) {
+	os << "P6\n" << width << " " << height << "\n" << max_value << "\n";
+	return os.good();
+}
+
+bool ppm::save_ppm_pixels(ostream& os, const vec3b* pixels, size_t count) {
+	os.write(reinterpret_cast<const char*>(pixels), count * 3);
+	return os.good();
+}
+
+bool ppm::save_ppm_pixels(ostream& os, const vec3w* pixels, size_t count) {
+	// Samples are big endian
+	vector<uint8_t> bytes(count * 6);
+	for (size_t i = 0; i < count; ++i)
+		for (size_t j = 0; j < 3; ++j) {
+			bytes[i * 6 + j * 2] = uint8_t(pixels[i][j] >> 8);
+			bytes[i * 6 + j * 2 + 1] = uint8_t(pixels[i][j] & 0xFF);
+		}
+	os.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+	return os.good();
+}
+
 bool ppm::read_ppm(istream& is, mat<vec3b>& img) {
 	string magic;
 	is >> magic;
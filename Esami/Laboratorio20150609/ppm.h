@@ -12,6 +12,14 @@ namespace ppm {
 	bool save_ppm(std::ostream& os, const core::mat<core::vec3b>& img,
 					ppm_type type = ppm_type::p6, std::string comment = "");
 
+	bool save_ppm(std::ostream& os, const core::mat<core::vec3w>& img,
+					ppm_type type = ppm_type::p6, std::string comment = "");
+
+	// Row by row writing of a P6 image: the header and then height * width pixels
+	bool save_ppm_header(std::ostream& os, size_t width, size_t height, uint32_t max_value = 255);
+	bool save_ppm_pixels(std::ostream& os, const core::vec3b* pixels, size_t count);
+	bool save_ppm_pixels(std::ostream& os, const core::vec3w* pixels, size_t count);
+
 	bool read_ppm(std::istream& is, core::mat<core::vec3b>& img);
 
 }
@@ -11,6 +11,11 @@
 #include <array>
 #include <sstream>
 #include <iomanip>
+#include <vector>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 
 using namespace std;
 using namespace image;
@@ -18,7 +23,15 @@ using namespace ppm;
 using namespace pgm;
 
 void syntax() {
-	cerr << "Syntax: y4mextract <inputfile>.y4m\n";
+	cerr << "Syntax: y4mextract [--frames <a>-<b>] [--threads <n>] [--in-flight <n>] <inputfile>.y4m\n";
+	cerr << "  --frames <a>-<b>  extract only the frames from a to b (numbered from 1)\n";
+	cerr << "  --threads <n>     number of conversion threads (default: one per core)\n";
+	cerr << "  --in-flight <n>   maximum number of frames in memory (default: twice the threads)\n";
+	cerr << "Syntax: y4mextract --encode <prefix> [--chroma <c>] [--filter <f>] [--in-flight <n>] <outputfile>.y4m\n";
+	cerr << "  --encode <prefix> encode <prefix>0001.ppm, <prefix>0002.ppm, ... up to the first missing one\n";
+	cerr << "  --chroma <c>      420jpeg (default), 420mpeg2, 420paldv, 422, 444 or mono\n";
+	cerr << "  --filter <f>      chroma downsampling: box (default) or 2tap\n";
+	cerr << "  --in-flight <n>   maximum number of frames in memory (default: twice the cores)\n";
 	exit(EXIT_FAILURE);
 }
 
@@ -108,17 +121,128 @@ uint8_t saturate_chroma(const uint8_t chroma) {
 	return chroma <= 16 ? 16 : chroma >= 240 ? 240 : chroma;
 }
 
-array<mat<uint8_t>, 3> read_frame(istream& is, size_t height, size_t width) {
-	read_frame_header(is);
-	size_t mid_height = size_t(ceil(height / 2.));
-	size_t mid_width = size_t(ceil(width / 2.));
+// Position of the chroma samples with respect to the luma ones along one axis: full resolution, between
+// two luma samples, on the first of them or on the second of them
+enum class siting { full, centered, first, second };
+
+// Chroma formats: subsampling of the chroma planes as shifts and siting of the chroma samples. In 420paldv
+// the Cr lines are on the even luma lines and the Cb ones on the odd luma lines.
+struct format_420jpeg {
+	static constexpr bool has_chroma = true;
+	static constexpr size_t x_shift = 1, y_shift = 1;
+	static constexpr siting x_siting = siting::centered;
+	static constexpr siting cb_y_siting = siting::centered, cr_y_siting = siting::centered;
+};
+
+struct format_420mpeg2 {
+	static constexpr bool has_chroma = true;
+	static constexpr size_t x_shift = 1, y_shift = 1;
+	static constexpr siting x_siting = siting::first;
+	static constexpr siting cb_y_siting = siting::centered, cr_y_siting = siting::centered;
+};
+
+struct format_420paldv {
+	static constexpr bool has_chroma = true;
+	static constexpr size_t x_shift = 1, y_shift = 1;
+	static constexpr siting x_siting = siting::first;
+	static constexpr siting cb_y_siting = siting::second, cr_y_siting = siting::first;
+};
+
+struct format_422 {
+	static constexpr bool has_chroma = true;
+	static constexpr size_t x_shift = 1, y_shift = 0;
+	static constexpr siting x_siting = siting::first;
+	static constexpr siting cb_y_siting = siting::full, cr_y_siting = siting::full;
+};
+
+struct format_444 {
+	static constexpr bool has_chroma = true;
+	static constexpr size_t x_shift = 0, y_shift = 0;
+	static constexpr siting x_siting = siting::full;
+	static constexpr siting cb_y_siting = siting::full, cr_y_siting = siting::full;
+};
+
+struct format_mono {
+	static constexpr bool has_chroma = false;
+	static constexpr size_t x_shift = 0, y_shift = 0;
+	static constexpr siting x_siting = siting::full;
+	static constexpr siting cb_y_siting = siting::full, cr_y_siting = siting::full;
+};
+
+template<typename F>
+inline size_t chroma_height(size_t height) {
+	return (height + (size_t(1) << F::y_shift) - 1) >> F::y_shift;
+}
+
+template<typename F>
+inline size_t chroma_width(size_t width) {
+	return (width + (size_t(1) << F::x_shift) - 1) >> F::x_shift;
+}
 
+// Number of bytes of the samples of a frame
+template<typename F>
+inline uint64_t frame_size(size_t height, size_t width) {
+	uint64_t size = uint64_t(height) * width;
+	if (F::has_chroma)
+		size += 2 * uint64_t(chroma_height<F>(height)) * chroma_width<F>(width);
+	return size;
+}
+
+// Offsets in the file of the samples of every frame. The stream must be on the first frame header.
+template<typename F>
+vector<uint64_t> index_frames(istream& is, size_t height, size_t width) {
+	const uint64_t samples = frame_size<F>(height, width);
+	const uint64_t start = uint64_t(is.tellg());
+	is.seekg(0, ios::end);
+	const uint64_t size = uint64_t(is.tellg());
+	const string plain_header = "FRAME\n";
+	vector<uint64_t> offsets;
+
+	// Most streams have frame headers without parameters: then the offsets are computed and only the
+	// headers are checked
+	const uint64_t stride = samples + plain_header.size();
+	if ((size - start) % stride == 0) {
+		string header(plain_header.size(), ' ');
+		for (uint64_t pos = start; pos < size; pos += stride) {
+			is.seekg(pos);
+			is.read(&header[0], header.size());
+			if (header != plain_header)
+				break;
+			offsets.push_back(pos + header.size());
+		}
+		if (offsets.size() == (size - start) / stride)
+			return offsets;
+	}
+
+	// Otherwise the headers are parsed one by one, skipping the samples. A truncated last frame is ignored.
+	offsets.clear();
+	is.clear();
+	is.seekg(start);
+	while (is.peek() == 'F') {
+		read_frame_header(is);
+		const uint64_t offset = uint64_t(is.tellg());
+		if (offset + samples > size)
+			break;
+		offsets.push_back(offset);
+		is.seekg(samples, ios::cur);
+	}
+	return offsets;
+}
+
+// Reads the samples of a frame, the stream must be after the frame header
+template<typename F>
+array<mat<uint8_t>, 3> read_channels(istream& is, size_t height, size_t width) {
 	// Read the y channel
 	mat<uint8_t> y(height, width);
 	is.read(reinterpret_cast<char*>(y.data()), height*width);
 
 	transform(begin(y), end(y), begin(y), saturate_y);
 
+	if (!F::has_chroma)
+		return { y, mat<uint8_t>(), mat<uint8_t>() };
+
+	const size_t mid_height = chroma_height<F>(height);
+	const size_t mid_width = chroma_width<F>(width);
 
 	// Read the cb channel
 	mat<uint8_t> cb(mid_height, mid_width);
@@ -146,71 +270,179 @@ inline string compose_index(size_t index) {
 	return ss.str();
 }
 
-mat<uint8_t> scale_up(const mat<uint8_t>& channel, size_t height, size_t width) {
-	mat<uint8_t> scaled_up(height, width);
+// Fixed point coefficients (16 fractional bits) of the YCbCr to RGB conversion
+const int32_t y_coeff = 76284;		// 1.164
+const int32_t r_cr_coeff = 104595;	// 1.596
+const int32_t g_cb_coeff = 25690;	// 0.392
+const int32_t g_cr_coeff = 53281;	// 0.813
+const int32_t b_cb_coeff = 132186;	// 2.017
 
-	for (size_t r = 0; r < height; ++r)
-		for (size_t c = 0; c < width; ++c)
-			scaled_up(r, c) = channel(r / 2, c / 2);
+inline uint8_t saturate_rgb(int32_t val) {
+	return uint8_t(val < 0 ? 0 : val > 255 ? 255 : val);
+}
+
+// Converts a row from its luma and its upsampled and saturated chroma. The loop is branch free, so the
+// compiler vectorises it.
+inline void ycbcr_row_to_rgb(const uint8_t* y, const uint8_t* cb, const uint8_t* cr, size_t width, vec3b* out) {
+	for (size_t c = 0; c < width; ++c) {
+		int32_t l = (int32_t(y[c]) - 16) * y_coeff;
+		int32_t b = int32_t(cb[c]) - 128;
+		int32_t r = int32_t(cr[c]) - 128;
+		out[c][0] = saturate_rgb((l + r_cr_coeff * r) >> 16);
+		out[c][1] = saturate_rgb((l - g_cb_coeff * b - g_cr_coeff * r) >> 16);
+		out[c][2] = saturate_rgb((l + b_cb_coeff * b) >> 16);
+	}
+}
 
-	return scaled_up;
+// Input rows of the vertical pass of a bilinear upsampling and weight of the first one in quarters. With centered siting
+// output i lies a quarter of a sample away from input i / 2, towards the previous input if i is even and
+// towards the next one if it is odd; with co-sited chroma it is either on an input or halfway between two.
+// At the borders the missing input is replaced by the nearest one.
+struct upsample_tap {
+	size_t first, second;
+	int32_t weight;
+};
+
+vector<upsample_tap> upsample_taps(size_t size, size_t source_size, siting s) {
+	vector<upsample_tap> taps(size);
+	for (size_t i = 0; i < size; ++i)
+		switch (s) {
+		case siting::full:
+			taps[i] = { i, i, 4 };
+			break;
+		case siting::centered:
+			if (i % 2 == 0)
+				taps[i] = { i == 0 ? 0 : i / 2 - 1, i / 2, 1 };
+			else
+				taps[i] = { i / 2, min(i / 2 + 1, source_size - 1), 3 };
+			break;
+		case siting::first:
+			if (i % 2 == 0)
+				taps[i] = { i / 2, i / 2, 4 };
+			else
+				taps[i] = { i / 2, min(i / 2 + 1, source_size - 1), 2 };
+			break;
+		case siting::second:
+			if (i % 2 == 1 || i == 0)
+				taps[i] = { i / 2, i / 2, 4 };
+			else
+				taps[i] = { i / 2 - 1, i / 2, 2 };
+			break;
+		}
+	return taps;
 }
 
-mat<uint8_t> bilinear_scale_up(const mat<uint8_t>& channel, size_t height, size_t width) {
-	mat<uint8_t> out(height, width);
+// Horizontal pass of the 2x bilinear upsampling of a row: the weights are always 1/4 and 3/4 (centered siting)
+// or 1/2 (co-sited chroma), so the output is 3a+b or 2a+2b, kept in quarters for the vertical pass. The first
+// and last outputs, which repeat the border sample, are handled out of the loop, which is branch free.
+template<siting S>
+void upsample_row_2x(const uint8_t* src, size_t source_size, size_t size, uint16_t* out) {
+	if (S == siting::full) {
+		for (size_t c = 0; c < size; ++c)
+			out[c] = uint16_t(4 * src[c]);
+		return;
+	}
 
-	for (size_t r = 0; r < height; ++r) {
-		double dr = (r + 0.5) / 2 - 0.5;
-		size_t rl = size_t(max(0., floor(dr)));
-		size_t rh = min(rl + 1, channel.height() - 1);
-		double wrh = dr - rl;
-		double wrl = 1 - wrh;
-		for (size_t c = 0; c < width; ++c) {
-			double dc = (c + 0.5) / 2 - 0.5;
-			size_t cl = size_t(max(0., floor(dc)));
-			size_t ch = min(cl + 1, channel.width() - 1);
-			double wch = dc - cl;
-			double wcl = 1 - wch;
-
-			uint8_t ll = channel(rl, cl);
-			uint8_t hl = channel(rh, cl);
-			uint8_t lh = channel(rl, ch);
-			uint8_t hh = channel(rh, ch);
-
-			out(r, c) = uint8_t(round(ll*wrl*wcl + lh * wrl*wch + hl * wrh*wcl + hh * wrh*wch));
+	const size_t last = source_size - 1;
+	for (size_t j = 1; j < last; ++j) {
+		if (S == siting::centered) {
+			out[2 * j] = uint16_t(3 * src[j] + src[j - 1]);
+			out[2 * j + 1] = uint16_t(3 * src[j] + src[j + 1]);
+		}
+		else {
+			out[2 * j] = uint16_t(4 * src[j]);
+			out[2 * j + 1] = uint16_t(2 * src[j] + 2 * src[j + 1]);
 		}
 	}
 
-	return out;
+	// Borders: the first pair, the last pair, which may have only its first output, and a single input
+	out[0] = uint16_t(4 * src[0]);
+	if (last == 0) {
+		if (size > 1)
+			out[1] = uint16_t(4 * src[0]);
+		return;
+	}
+	if (size > 1)
+		out[1] = S == siting::centered ? uint16_t(3 * src[0] + src[1]) : uint16_t(2 * src[0] + 2 * src[1]);
+	out[2 * last] = S == siting::centered ? uint16_t(3 * src[last] + src[last - 1]) : uint16_t(4 * src[last]);
+	if (2 * last + 1 < size)
+		out[2 * last + 1] = uint16_t(4 * src[last]);
 }
 
-mat<vec3b> compose(const array<mat<uint8_t>, 3>& channels) {
-	size_t height = channels[0].height();
-	size_t width = channels[0].width();
-	mat<vec3b> out(height, width);
-
-	for (size_t r = 0; r < height; ++r)
-		for (size_t c = 0; c < width; ++c)
-			for (size_t i = 0; i < 3; ++i)
-				out(r, c)[i] = channels[i](r, c);
-
-	return out;
+// Vertical pass: blends two horizontally upsampled rows with weight w and 4 - w and rounds the sixteenths
+inline void blend_rows(const uint16_t* first, const uint16_t* second, int32_t w, size_t size, uint8_t* out) {
+	for (size_t c = 0; c < size; ++c)
+		out[c] = saturate_chroma(uint8_t((w * first[c] + (4 - w) * second[c] + 8) >> 4));
 }
 
-vec3b YCbCr2RGB(const vec3b& YCbCr) {
-	double y = YCbCr[0] - 16.;
-	double cb = YCbCr[1] - 128.;
-	double cr = YCbCr[2] - 128.;
+// Nearest and bilinear chroma upsampling, chroma saturation and conversion to RGB in a single pass over
+// the rows of the frame: every output row is built in row buffers and converted as soon as it is ready.
+// The format is a template parameter, so the subsampling is known at compile time.
+template<typename F>
+void convert_frame(const array<mat<uint8_t>, 3>& frame, mat<vec3b>& nearest, mat<vec3b>& bilinear) {
+	const size_t height = frame[0].height();
+	const size_t width = frame[0].width();
+	nearest.resize(height, width);
+	bilinear.resize(height, width);
+	if (height == 0 || width == 0)
+		return;
+
+	if (!F::has_chroma || (F::x_shift == 0 && F::y_shift == 0)) {
+		// Nothing to upsample: both outputs are the same. Without chroma planes the chroma is neutral.
+		vector<uint8_t> cb(width, 128), cr(width, 128);
+		for (size_t r = 0; r < height; ++r) {
+			if (F::has_chroma)
+				for (size_t c = 0; c < width; ++c) {
+					cb[c] = saturate_chroma(frame[1](r, c));
+					cr[c] = saturate_chroma(frame[2](r, c));
+				}
+			ycbcr_row_to_rgb(&frame[0](r, 0), cb.data(), cr.data(), width, &nearest(r, 0));
+		}
+		bilinear = nearest;
+		return;
+	}
 
-	double r = y * 1.164 + 1.596 * cr;
-	double g = y * 1.164 - cb * 0.392 - cr * 0.813;
-	double b = y * 1.164 + cb * 2.017;
+	const array<vector<upsample_tap>, 2> row_taps{ {
+		upsample_taps(height, frame[1].height(), F::cb_y_siting),
+		upsample_taps(height, frame[2].height(), F::cr_y_siting)
+	} };
+	array<vector<uint8_t>, 2> nearest_chroma{ { vector<uint8_t>(width), vector<uint8_t>(width) } };
+	array<vector<uint8_t>, 2> bilinear_chroma{ { vector<uint8_t>(width), vector<uint8_t>(width) } };
+
+	// Horizontal pass of the last two input rows of every plane. The two rows used by an output row are the
+	// same or consecutive, so they are cached by the parity of their index and each one is computed once.
+	array<array<vector<uint16_t>, 2>, 2> upsampled;
+	array<array<size_t, 2>, 2> upsampled_row;
+	for (size_t i = 0; i < 2; ++i)
+		for (size_t k = 0; k < 2; ++k) {
+			upsampled[i][k].resize(width);
+			upsampled_row[i][k] = size_t(-1);
+		}
+	auto upsampled_row_of = [&](size_t i, size_t row) -> const uint16_t* {
+		vector<uint16_t>& buffer = upsampled[i][row & 1];
+		if (upsampled_row[i][row & 1] != row) {
+			upsample_row_2x<F::x_siting>(&frame[i + 1](row, 0), frame[i + 1].width(), width, buffer.data());
+			upsampled_row[i][row & 1] = row;
+		}
+		return buffer.data();
+	};
 
-	uint8_t R = r < 0. ? uint8_t(0) : r > 255. ? uint8_t(255) : uint8_t(r);
-	uint8_t G = g < 0. ? uint8_t(0) : g > 255. ? uint8_t(255) : uint8_t(g);
-	uint8_t B = b < 0. ? uint8_t(0) : b > 255. ? uint8_t(255) : uint8_t(b);
+	for (size_t r = 0; r < height; ++r) {
+		for (size_t i = 0; i < 2; ++i) {
+			const upsample_tap& rt = row_taps[i][r];
+			const uint8_t* near_row = &frame[i + 1](r >> F::y_shift, 0);
+			uint8_t* near_out = nearest_chroma[i].data();
+			for (size_t c = 0; c < width; ++c)
+				near_out[c] = saturate_chroma(near_row[c >> F::x_shift]);
+
+			const uint16_t* first_row = upsampled_row_of(i, rt.first);
+			const uint16_t* second_row = upsampled_row_of(i, rt.second);
+			blend_rows(first_row, second_row, rt.weight, width, bilinear_chroma[i].data());
+		}
 
-	return { R, G, B };
+		ycbcr_row_to_rgb(&frame[0](r, 0), nearest_chroma[0].data(), nearest_chroma[1].data(), width, &nearest(r, 0));
+		ycbcr_row_to_rgb(&frame[0](r, 0), bilinear_chroma[0].data(), bilinear_chroma[1].data(), width, &bilinear(r, 0));
+	}
 }
 
 inline void write_ppm(const mat<vec3b>& img, const string& filename) {
@@ -222,7 +454,159 @@ inline void write_ppm(const mat<vec3b>& img, const string& filename) {
 		error("Error on saving an output file.");
 }
 
-void y4mextract(const string& input_file) {
+// Blocking queue with a maximum number of items, used to connect the stages of the extraction
+template<typename T>
+class bounded_queue {
+public:
+	explicit bounded_queue(size_t capacity) : capacity_(capacity), closed_(false) {}
+
+	void push(T item) {
+		unique_lock<mutex> lock(mutex_);
+		not_full_.wait(lock, [this]() { return items_.size() < capacity_; });
+		items_.push_back(move(item));
+		not_empty_.notify_one();
+	}
+
+	// Returns false when the queue is closed and empty
+	bool pop(T& item) {
+		unique_lock<mutex> lock(mutex_);
+		not_empty_.wait(lock, [this]() { return !items_.empty() || closed_; });
+		if (items_.empty())
+			return false;
+		item = move(items_.front());
+		items_.pop_front();
+		not_full_.notify_one();
+		return true;
+	}
+
+	void close() {
+		lock_guard<mutex> lock(mutex_);
+		closed_ = true;
+		not_empty_.notify_all();
+	}
+
+private:
+	size_t capacity_;
+	bool closed_;
+	deque<T> items_;
+	mutex mutex_;
+	condition_variable not_full_, not_empty_;
+};
+
+// Number of frames that can be read before the writer has saved them
+class frame_budget {
+public:
+	explicit frame_budget(size_t frames) : available_(frames) {}
+
+	void acquire() {
+		unique_lock<mutex> lock(mutex_);
+		released_.wait(lock, [this]() { return available_ > 0; });
+		--available_;
+	}
+
+	void release() {
+		lock_guard<mutex> lock(mutex_);
+		++available_;
+		released_.notify_one();
+	}
+
+private:
+	size_t available_;
+	mutex mutex_;
+	condition_variable released_;
+};
+
+struct frame_job {
+	size_t index;
+	uint64_t offset;
+};
+
+struct frame_result {
+	size_t index;
+	mat<uint8_t> y;
+	array<mat<vec3b>, 2> rebuilt;
+};
+
+void write_frame(const frame_result& frame) {
+	const string index_string = compose_index(frame.index);
+	write_y_channel(frame.y, "extract/Y" + index_string + ".pgm");
+	write_ppm(frame.rebuilt[0], "extract/frame" + index_string + ".ppm");
+	write_ppm(frame.rebuilt[1], "extract/inter" + index_string + ".ppm");
+}
+
+// Frames to extract, numbered from 1. last == 0 means up to the last frame.
+struct frame_range {
+	size_t first, last;
+};
+
+// A dispatcher thread hands the selected frames, in order, to the conversion threads, which read them at their
+// offset with their own stream, so reading is parallel too. The results are saved in order by a writer thread.
+// At most max_in_flight frames are between the dispatcher and the writer.
+template<typename F>
+void extract_frames(const string& input_file, istream& is, size_t height, size_t width, frame_range range,
+					size_t n_threads, size_t max_in_flight) {
+	const auto offsets = index_frames<F>(is, height, width);
+	if (range.last == 0)
+		range.last = offsets.size();
+	if (range.first > range.last || range.last > offsets.size())
+		error("The stream has " + to_string(offsets.size()) + " frames.");
+
+	bounded_queue<frame_job> jobs(max_in_flight);
+	bounded_queue<frame_result> results(max_in_flight);
+	frame_budget budget(max_in_flight);
+
+	thread dispatcher([&]() {
+		for (size_t index = range.first; index <= range.last; ++index) {
+			budget.acquire();
+			jobs.push({ index, offsets[index - 1] });
+		}
+		jobs.close();
+	});
+
+	vector<thread> workers;
+	for (size_t i = 0; i < n_threads; ++i)
+		workers.emplace_back([&]() {
+			ifstream frame_is(input_file, ios::binary);
+			if (!frame_is)
+				error("Cannot open input file.");
+			frame_job job;
+			while (jobs.pop(job)) {
+				frame_is.seekg(job.offset);
+				auto channels = read_channels<F>(frame_is, height, width);
+				if (!frame_is)
+					error("Cannot read frame " + to_string(job.index) + ".");
+
+				frame_result result;
+				result.index = job.index;
+				convert_frame<F>(channels, result.rebuilt[0], result.rebuilt[1]);
+				result.y = move(channels[0]);
+				results.push(move(result));
+			}
+		});
+
+	thread writer([&]() {
+		// Frames are completed in any order, each one waits here until the previous ones are written
+		map<size_t, frame_result> pending;
+		size_t next = range.first;
+		frame_result result;
+		while (results.pop(result)) {
+			pending.emplace(result.index, move(result));
+			for (auto it = pending.find(next); it != end(pending); it = pending.find(++next)) {
+				write_frame(it->second);
+				pending.erase(it);
+				budget.release();
+			}
+		}
+	});
+
+	dispatcher.join();
+	for (auto& w : workers)
+		w.join();
+	results.close();
+	writer.join();
+}
+
+void y4mextract(const string& input_file, frame_range range, size_t n_threads, size_t max_in_flight) {
 	if (!check_extension(input_file, ".y4m"))
 		error("Input file must be a .y4m file.");
 	ifstream is(input_file, ios::binary);
@@ -230,52 +614,276 @@ void y4mextract(const string& input_file) {
 		error("Cannot open input file.");
 
 	const auto header_fields = read_stream_header(is);
-	if (header_fields.at("chroma_subsampling") != "420jpeg")
-		error("I'm sorry. This program supports only 420jpeg.");
-
 	const size_t height = size_t(stoi(header_fields.at("height")));
 	const size_t width = size_t(stoi(header_fields.at("width")));
 
-	size_t index = 0;
-	while (is.peek() == 'F') {
-		array<mat<uint8_t>, 3> frame = read_frame(is, height, width);
-
-		const string index_string = compose_index(++index);
-		const string y_channel = "extract/Y" + index_string + ".pgm";
-		write_y_channel(frame[0], y_channel);
-
-		array<mat<uint8_t>, 3> simple_scale;
-		array<mat<uint8_t>, 3> bilinear_scale_up;
-		simple_scale[0] = bilinear_scale_up[0] = frame[0];
-		for (size_t i = 1; i < 3; ++i) {
-			simple_scale[i] = scale_up(frame[i], height, width);
-			transform(begin(simple_scale[i]), end(simple_scale[i]), begin(simple_scale[i]), saturate_chroma);
-			bilinear_scale_up[i] = ::bilinear_scale_up(frame[i], height, width);
-			transform(begin(bilinear_scale_up[i]), end(bilinear_scale_up[i]), begin(bilinear_scale_up[i]), saturate_chroma);
+	// The format is chosen once here, every frame then goes through the kernels compiled for it
+	const string& chroma = header_fields.at("chroma_subsampling");
+	if (chroma == "420jpeg")
+		extract_frames<format_420jpeg>(input_file, is, height, width, range, n_threads, max_in_flight);
+	else
+		if (chroma == "420mpeg2")
+			extract_frames<format_420mpeg2>(input_file, is, height, width, range, n_threads, max_in_flight);
+		else
+			if (chroma == "420paldv")
+				extract_frames<format_420paldv>(input_file, is, height, width, range, n_threads, max_in_flight);
+			else
+				if (chroma == "422")
+					extract_frames<format_422>(input_file, is, height, width, range, n_threads, max_in_flight);
+				else
+					if (chroma == "444")
+						extract_frames<format_444>(input_file, is, height, width, range, n_threads, max_in_flight);
+					else
+						if (chroma == "mono")
+							extract_frames<format_mono>(input_file, is, height, width, range, n_threads, max_in_flight);
+						else
+							error("Chroma subsampling " + chroma + " is not supported.");
+}
+
+
+// Fixed point coefficients (16 fractional bits) of the RGB to YCbCr conversion, the inverse of the one above
+const int32_t y_r_coeff = 16829, y_g_coeff = 33039, y_b_coeff = 6416;		// 0.257 0.504 0.098
+const int32_t cb_r_coeff = -9714, cb_g_coeff = -19070, cb_b_coeff = 28784;	// -0.148 -0.291 0.439
+const int32_t cr_r_coeff = 28784, cr_g_coeff = -24103, cr_b_coeff = -4681;	// 0.439 -0.368 -0.071
+
+// Converts a row to luma and to full resolution chroma, which keeps the 16 fractional bits for the
+// downsampling. The loop is branch free, so the compiler vectorises it.
+inline void rgb_row_to_ycbcr(const vec3b* in, size_t width, uint8_t* y, int32_t* cb, int32_t* cr) {
+	for (size_t c = 0; c < width; ++c) {
+		int32_t r = in[c][0], g = in[c][1], b = in[c][2];
+		y[c] = uint8_t(((16 << 16) + (1 << 15) + y_r_coeff * r + y_g_coeff * g + y_b_coeff * b) >> 16);
+		cb[c] = (128 << 16) + cb_r_coeff * r + cb_g_coeff * g + cb_b_coeff * b;
+		cr[c] = (128 << 16) + cr_r_coeff * r + cr_g_coeff * g + cr_b_coeff * b;
+	}
+}
+
+// Chroma downsampling filters: box averages all the samples covered by a chroma sample, 2tap interpolates
+// linearly at the chroma siting, so it averages with centered siting and takes the sample with co-sited chroma
+enum class chroma_filter { box, two_tap };
+
+// Input samples of a chroma sample along one axis and weight of the first one in halves. At the borders the
+// missing input is replaced by the last one.
+struct downsample_tap {
+	size_t first, second;
+	int32_t weight;
+};
+
+vector<downsample_tap> downsample_taps(size_t size, size_t source_size, siting s, chroma_filter filter) {
+	vector<downsample_tap> taps(size);
+	for (size_t j = 0; j < size; ++j) {
+		const size_t first = s == siting::full ? j : 2 * j;
+		const size_t second = min(first + 1, source_size - 1);
+		if (s == siting::full)
+			taps[j] = { j, j, 2 };
+		else
+			if (filter == chroma_filter::box || s == siting::centered)
+				taps[j] = { first, second, 1 };
+			else
+				if (s == siting::first)
+					taps[j] = { first, first, 2 };
+				else
+					taps[j] = { second, second, 2 };
+	}
+	return taps;
+}
+
+// Horizontal pass of the downsampling: the outputs are in halves
+inline void downsample_row(const int32_t* src, const vector<downsample_tap>& taps, int32_t* out) {
+	for (size_t j = 0; j < taps.size(); ++j)
+		out[j] = taps[j].weight * src[taps[j].first] + (2 - taps[j].weight) * src[taps[j].second];
+}
+
+// Vertical pass: blends two horizontally downsampled rows in halves and rounds away the fractional bits
+inline void blend_chroma_rows(const int32_t* first, const int32_t* second, int32_t w, size_t size, uint8_t* out) {
+	for (size_t c = 0; c < size; ++c)
+		out[c] = uint8_t((w * first[c] + (2 - w) * second[c] + (1 << 17)) >> 18);
+}
+
+// Conversion and chroma downsampling in a single pass over the rows of the image. The horizontal pass of the
+// last two rows is kept, indexed by the parity of the row, and a chroma row is completed as soon as its last
+// input row is converted.
+template<typename F>
+void encode_frame(const mat<vec3b>& img, chroma_filter filter, array<mat<uint8_t>, 3>& frame) {
+	const size_t height = img.height();
+	const size_t width = img.width();
+	const size_t mid_height = chroma_height<F>(height);
+	const size_t mid_width = chroma_width<F>(width);
+	frame[0].resize(height, width);
+	frame[1].resize(F::has_chroma ? mid_height : 0, F::has_chroma ? mid_width : 0);
+	frame[2].resize(F::has_chroma ? mid_height : 0, F::has_chroma ? mid_width : 0);
+
+	const auto column_taps = downsample_taps(mid_width, width, F::x_siting, filter);
+	const array<vector<downsample_tap>, 2> row_taps{ {
+		downsample_taps(mid_height, height, F::cb_y_siting, filter),
+		downsample_taps(mid_height, height, F::cr_y_siting, filter)
+	} };
+	array<vector<int32_t>, 2> chroma{ { vector<int32_t>(width), vector<int32_t>(width) } };
+	array<array<vector<int32_t>, 2>, 2> downsampled;
+	for (auto& plane : downsampled)
+		for (auto& row : plane)
+			row.resize(mid_width);
+
+	for (size_t r = 0; r < height; ++r) {
+		rgb_row_to_ycbcr(&img(r, 0), width, &frame[0](r, 0), chroma[0].data(), chroma[1].data());
+		if (!F::has_chroma)
+			continue;
+
+		for (size_t i = 0; i < 2; ++i)
+			downsample_row(chroma[i].data(), column_taps, downsampled[i][r & 1].data());
+
+		// The last input row of chroma row j is 2j + 1, or the last row of the image
+		if (F::y_shift == 1 && r % 2 == 0 && r != height - 1)
+			continue;
+		const size_t j = r >> F::y_shift;
+		for (size_t i = 0; i < 2; ++i) {
+			const downsample_tap& rt = row_taps[i][j];
+			blend_chroma_rows(downsampled[i][rt.first & 1].data(), downsampled[i][rt.second & 1].data(), rt.weight,
+							  mid_width, &frame[i + 1](j, 0));
 		}
+	}
+}
 
-		array<mat<vec3b>, 2> rebuilt_frames;
-		rebuilt_frames[0] = compose(simple_scale);
-		rebuilt_frames[1] = compose(bilinear_scale_up);
-		
+void write_frame_samples(ostream& os, const array<mat<uint8_t>, 3>& frame) {
+	os << "FRAME\n";
+	for (const auto& channel : frame)
+		os.write(reinterpret_cast<const char*>(channel.data()), channel.height()*channel.width());
+}
 
-		for (auto& f : rebuilt_frames)
-			transform(begin(f), end(f), begin(f), YCbCr2RGB);
+// The frames are loaded and converted in order, while a writer thread saves the previous ones. At most
+// max_in_flight converted frames wait for the writer.
+template<typename F>
+void encode_frames(const string& prefix, ostream& os, const string& chroma, chroma_filter filter,
+				   size_t max_in_flight) {
+	size_t height = 0, width = 0;
+	bounded_queue<array<mat<uint8_t>, 3>> frames(max_in_flight);
+	thread writer;
+
+	size_t index = 1;
+	for (;; ++index) {
+		ifstream is(prefix + compose_index(index) + ".ppm", ios::binary);
+		if (!is)
+			break;
+		mat<vec3b> img;
+		if (!load_ppm(is, img))
+			error("Cannot read frame " + to_string(index) + ".");
+
+		if (index == 1) {
+			height = img.height();
+			width = img.width();
+			os << "YUV4MPEG2 W" << width << " H" << height << " F25:1 Ip A1:1 C" << chroma << "\n";
+			writer = thread([&]() {
+				array<mat<uint8_t>, 3> frame;
+				while (frames.pop(frame))
+					write_frame_samples(os, frame);
+			});
+		}
+		else
+			if (img.height() != height || img.width() != width)
+				error("Frame " + to_string(index) + " has a different size.");
 
-		string fr = "extract/frame" + index_string + ".ppm";
-		write_ppm(rebuilt_frames[0], fr);
-		string inter = "extract/inter" + index_string + ".ppm";
-		write_ppm(rebuilt_frames[1], inter);
+		array<mat<uint8_t>, 3> frame;
+		encode_frame<F>(img, filter, frame);
+		frames.push(move(frame));
 	}
+
+	frames.close();
+	if (writer.joinable())
+		writer.join();
+	if (index == 1)
+		error("Cannot open " + prefix + compose_index(1) + ".ppm.");
+	if (!os)
+		error("Error on writing the output file.");
+}
+
+void y4mencode(const string& prefix, const string& output_file, const string& chroma, chroma_filter filter,
+			   size_t max_in_flight) {
+	if (!check_extension(output_file, ".y4m"))
+		error("Output file must be a .y4m file.");
+	ofstream os(output_file, ios::binary);
+	if (!os)
+		error("Cannot open output file.");
+
+	if (chroma == "420jpeg")
+		encode_frames<format_420jpeg>(prefix, os, chroma, filter, max_in_flight);
+	else
+		if (chroma == "420mpeg2")
+			encode_frames<format_420mpeg2>(prefix, os, chroma, filter, max_in_flight);
+		else
+			if (chroma == "420paldv")
+				encode_frames<format_420paldv>(prefix, os, chroma, filter, max_in_flight);
+			else
+				if (chroma == "422")
+					encode_frames<format_422>(prefix, os, chroma, filter, max_in_flight);
+				else
+					if (chroma == "444")
+						encode_frames<format_444>(prefix, os, chroma, filter, max_in_flight);
+					else
+						if (chroma == "mono")
+							encode_frames<format_mono>(prefix, os, chroma, filter, max_in_flight);
+						else
+							error("Chroma subsampling " + chroma + " is not supported.");
 }
 
 
 int main(const int argc, char **argv) {
-	if (argc != 2)
-		syntax();
+	size_t n_threads = max(1u, thread::hardware_concurrency());
+	size_t max_in_flight = 0;
+	frame_range range{ 1, 0 };
+	string encode_prefix, chroma = "420jpeg";
+	chroma_filter filter = chroma_filter::box;
+	int i = 1;
+	for (; i < argc - 1; i += 2) {
+		const string option(argv[i]);
+		const string value(argv[i + 1]);
+		if (option == "--frames") {
+			// a-b or a single frame
+			char* end;
+			range.first = strtoul(value.c_str(), &end, 10);
+			range.last = *end == '-' ? strtoul(end + 1, &end, 10) : range.first;
+			if (*end != '\0' || range.first == 0 || range.last < range.first)
+				syntax();
+			continue;
+		}
+		if (option == "--encode") {
+			encode_prefix = value;
+			continue;
+		}
+		if (option == "--chroma") {
+			chroma = value;
+			continue;
+		}
+		if (option == "--filter") {
+			if (value == "box")
+				filter = chroma_filter::box;
+			else
+				if (value == "2tap")
+					filter = chroma_filter::two_tap;
+				else
+					syntax();
+			continue;
+		}
 
-	const string input(argv[1]);
-	y4mextract(input);
+		const size_t number = strtoul(value.c_str(), nullptr, 10);
+		if (number == 0)
+			syntax();
+		if (option == "--threads")
+			n_threads = number;
+		else
+			if (option == "--in-flight")
+				max_in_flight = number;
+			else
+				syntax();
+	}
+	if (i != argc - 1)
+		syntax();
+	if (max_in_flight == 0)
+		max_in_flight = 2 * n_threads;
+
+	const string file(argv[i]);
+	if (encode_prefix.empty())
+		y4mextract(file, range, n_threads, max_in_flight);
+	else
+		y4mencode(encode_prefix, file, chroma, filter, max_in_flight);
 	cout << "Done!!!\n";
 
 	return EXIT_SUCCESS;
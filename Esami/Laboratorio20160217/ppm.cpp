@@ -7,6 +7,42 @@ using namespace image;
 using namespace ppm;
 
 
+bool ppm::load_ppm(istream& is, mat<vec3b>& img) {
+	string magic;
+	is >> magic;
+	is.get();
+	if ((magic != "P3" && magic != "P6") || !is)
+		return false;
+
+	if (is.peek() == '#') {
+		string comment;
+		getline(is, comment);
+		if (!is)
+			return false;
+	}
+
+	size_t width, height;
+	uint16_t val;
+	is >> width >> height >> val;
+	is.get();
+	if (!is || val != 255)
+		return false;
+
+	img.resize(height, width);
+	if (magic == "P6")
+		is.read(reinterpret_cast<char*>(img.data()), height * width * 3);
+	else
+		for (auto& pixel : img) {
+			uint32_t v;
+			for (size_t i = 0; i < 3; ++i) {
+				is >> v;
+				pixel[i] = v;
+			}
+		}
+
+	return bool(is);
+}
+
 bool ppm::save_ppm(ostream& os, const mat<vec3b>& img, ppm_type type, string&& comment) {
 	if (type == ppm_type::p6)
 		os << "P6\n";
@@ -25,4 +61,4 @@ bool ppm::save_ppm(ostream& os, const mat<vec3b>& img, ppm_type type, string&& c
 			os << out[0] << " " << out[1] << " " << out[2] << " ";
 
 	return os.good();
-}
+}
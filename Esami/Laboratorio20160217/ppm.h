@@ -8,6 +8,7 @@ namespace ppm {
 	
 	enum class ppm_type {p3, p6};
 
+	bool load_ppm(std::istream& is, image::mat<image::vec3b>& img);
 	bool save_ppm(std::ostream& os, const image::mat<image::vec3b>& img,
 						ppm_type type = ppm_type::p6, std::string&& comment = "");
 
@@ -7,9 +7,12 @@
 #include "vector_graphics.h"
 #include <cstdlib>
 #include <string>
+#include <string_view>
 #include <array>
 #include <algorithm>
 #include <iomanip>
+#include <thread>
+#include <atomic>
 
 using namespace std;
 using namespace core;
@@ -21,7 +24,9 @@ using namespace ppm;
 //////////////////////////////
 
 void syntax() {
-	cout << "Usage: image_extract <input_file>.txt <output_file_prefix>\n";
+	cout << "Usage: image_extract [--stream] <input_file>.txt <output_file_prefix>\n";
+	cout << "With --stream every image is written as soon as it is read, without keeping the document\n";
+	cout << "in memory: a hidden field must then come before the other contents of its object\n";
 	exit(EXIT_FAILURE);
 }
 
@@ -42,10 +47,10 @@ inline bool check_extension(const string& filename, string&& extension) {
 /***********************************************************
  * Check if image object contains all the required field****
  ***********************************************************/
-inline bool check_image_object(const element& image_element) {
+inline bool check_image_object(const node& image_element) {
 	if (!image_element.contains("data"))
 		return false;
-	const element& data_element = image_element["data"];
+	const node& data_element = image_element["data"];
 	const array<string, 3> required_data_fields = { "height", "width", "pixel" };
 	for (const auto& field : required_data_fields)
 		if (!data_element.contains(field) && data_element[field].type() != type::value)
@@ -53,113 +58,281 @@ inline bool check_image_object(const element& image_element) {
 	return true;
 }
 
-char char_to_b64(char c) {
-	if (c >= 65 && c <= 90)
-		return c - 65;
-	if (c >= 97 && c <= 122)
-		return c - 71;
-	if (c >= 48 && c <= 57)
-		return c + 4;
-	if (c == 43)
-		return 62;
-	if (c == 47)
-		return 63;
-	if (c == '=')
-		return c;
-	error("Char in econding base 64 not recognized.");
-	return 0;
-}
-
-vec3b pixel_decode(array<char, 4>& b64_chars) {
-	// simplified version
-	transform(begin(b64_chars), end(b64_chars), begin(b64_chars), char_to_b64);
+// Base 64 value of every character. The whitespace which can break the pixel string is skipped and any other
+// character is not allowed. The = is read as its own code, as the pixels are never padded.
+const uint8_t b64_skip = 0xFE, b64_invalid = 0xFF;
 
-	vec3b pixel;
-	pixel[0] = (b64_chars[0] << 2 | ((b64_chars[1] & 0x30) >> 4));
-	pixel[1] = (((b64_chars[1] & 0x0F) << 4) | (((b64_chars[2] & 0x3C) >> 2)));
-	pixel[2] = (((b64_chars[2] & 0x03) << 6) | ((b64_chars[3] & 0x3F)));
+const array<uint8_t, 256> b64_table = []() {
+	array<uint8_t, 256> table;
+	table.fill(b64_invalid);
+	for (uint8_t i = 0; i < 26; ++i) {
+		table['A' + i] = i;
+		table['a' + i] = 26 + i;
+	}
+	for (uint8_t i = 0; i < 10; ++i)
+		table['0' + i] = 52 + i;
+	table['+'] = 62;
+	table['/'] = 63;
+	table['='] = '=';
+	table[' '] = table['\n'] = table['\r'] = table['\t'] = b64_skip;
+	return table;
+}();
 
-	return pixel;
+inline void write_pixel(const uint32_t c0, const uint32_t c1, const uint32_t c2, const uint32_t c3, uint8_t* out) {
+	out[0] = uint8_t(c0 << 2 | c1 >> 4);
+	out[1] = uint8_t((c1 & 0x0F) << 4 | c2 >> 2);
+	out[2] = uint8_t((c2 & 0x03) << 6 | c3);
 }
 
-mat<vec3b> decode(const size_t height, const size_t width, const value& pixels) {
+// Decodes the pixel string in a single pass straight into the image, four characters every pixel. Groups
+// without whitespace, which are almost all of them, are decoded directly; a group broken by whitespace is
+// gathered one character at a time.
+mat<vec3b> decode(const size_t height, const size_t width, const string_view pixels) {
 	mat<vec3b> image(height, width);
+	uint8_t* out = reinterpret_cast<uint8_t*>(image.data());
+	uint8_t* const out_end = out + height * width * 3;
+	const uint8_t* in = reinterpret_cast<const uint8_t*>(pixels.data());
+	const uint8_t* const in_end = in + pixels.size();
 
-	auto str_it = begin(pixels);
-	for (size_t r = 0; r < height; ++r) {
-		for (size_t c = 0; c < width; ++c) {
-			array<char, 4> b64_chars{};
-			copy_n(str_it, 4, begin(b64_chars));
-			str_it += 4;
-			image(r, c) = pixel_decode(b64_chars);
+	while (out != out_end) {
+		for (; out != out_end && in_end - in >= 4; in += 4, out += 3) {
+			const uint32_t c0 = b64_table[in[0]], c1 = b64_table[in[1]], c2 = b64_table[in[2]], c3 = b64_table[in[3]];
+			if ((c0 | c1 | c2 | c3) & 0x80)
+				break;
+			write_pixel(c0, c1, c2, c3, out);
 		}
+		if (out == out_end)
+			break;
+
+		array<uint32_t, 4> group;
+		for (size_t k = 0; k < 4; ++in) {
+			if (in == in_end)
+				throw logic_error("The pixel string is shorter than the image.");
+			const uint8_t c = b64_table[*in];
+			if (c == b64_invalid)
+				throw logic_error("Char in econding base 64 not recognized.");
+			if (c != b64_skip)
+				group[k++] = c;
+		}
+		write_pixel(group[0], group[1], group[2], group[3], out);
+		out += 3;
 	}
 
 	return image;
 }
 
-void write_image(const mat<vec3b>& image, const string& output_prefix, size_t& index) {
+void write_image(const mat<vec3b>& image, const string& output_prefix, const size_t index) {
 	stringstream ss;
 	ss << setw(4) << setfill('0') << int32_t(index);
 
 	ofstream os(output_prefix + ss.str() + ".ppm", ios::binary);
 	if (!os)
-		error("Error on opening the output image.");
+		throw runtime_error("Error on opening the output image.");
 
 	if (!save_ppm(os, image))
-		error("Error on saving an image.");
+		throw runtime_error("Error on saving an image.");
 }
 
 
-void visit(const element& el, const string& output_prefix, size_t& index) {
+// An image found in the document, with the number of its output file already given
+struct image_job {
+	size_t height, width;
+	string_view pixels;
+	size_t index;
+	string error_message;
+};
+
+void visit(const node& el, vector<image_job>& jobs) {
 	if (el.is_hidden())
 		return;
 	if (el.element_name() == "image") {
 		if (!check_image_object(el))
-			error("Image object not formatted correctly.");
-		const element& data = el["data"];
+			throw logic_error("Image object not formatted correctly.");
+		const node& data = el["data"];
 		const size_t height = size_t(stoi(data["height"].value()));
 		const size_t width = size_t(stoi(data["width"].value()));
-		value pixels = data["pixel"].value();
-		size_t i = string::npos;
-		while ((i = pixels.find('\n')) != string::npos)
-			pixels.replace(i, 1, "");
-		while ((i = pixels.find(' ')) != string::npos)
-			pixels.replace(i, 1, "");
-		const mat<vec3b> image = decode(height, width, pixels);
-		write_image(image, output_prefix, index);
+		// Base 64 has no quotes, so the pixels are decoded from the text of the document without copying them
+		jobs.push_back({ height, width, data["pixel"].raw_value(), jobs.size() + 1, string() });
 	}
 	if (el.type() == type::object)
-		for (const auto& e : el.object())
-			if (e.type() == type::object)
-				visit(e, output_prefix, index);
+		for (const node* e = el.first_child(); e != nullptr; e = e->next_sibling())
+			if (e->type() == type::object)
+				visit(*e, jobs);
 }
 
+// The images are decoded and written by a pool of threads, each taking the next job not yet started. A job
+// which fails keeps its message and the one with the lowest number is reported, whatever the order of the
+// threads.
+void run_jobs(vector<image_job>& jobs, const string& output_prefix) {
+	atomic<size_t> next(0);
+	auto worker = [&]() {
+		for (size_t i = next++; i < jobs.size(); i = next++) {
+			image_job& job = jobs[i];
+			try {
+				write_image(decode(job.height, job.width, job.pixels), output_prefix, job.index);
+			}
+			catch (const exception& e) {
+				job.error_message = e.what();
+			}
+		}
+	};
+
+	const size_t n_threads = min<size_t>(max(1u, thread::hardware_concurrency()), jobs.size());
+	vector<thread> workers;
+	for (size_t t = 1; t < n_threads; ++t)
+		workers.emplace_back(worker);
+	worker();
+	for (auto& w : workers)
+		w.join();
+
+	for (auto& job : jobs)
+		if (!job.error_message.empty())
+			error(move(job.error_message));
+}
+
+
+// Extraction driven by the parsing events. Every open object has a frame on the stack with its kind, the
+// hidden flag inherited from its parents and, for the data of an image, the fields read so far. The image is
+// decoded and written as soon as its pixels have been read, so only one image at a time is in memory.
+class image_extractor: public event_handler {
+public:
+	image_extractor(const string& output_prefix) : output_prefix_(output_prefix), index_(1) {}
+
+	void begin_object(const string& name) override {
+		frame f;
+		f.hidden = !stack_.empty() && stack_.back().hidden;
+		f.first_index = index_;
+		if (name == "image")
+			f.object_kind = kind::image;
+		else
+			if (name == "data" && !stack_.empty() && stack_.back().object_kind == kind::image && !stack_.back().has_data) {
+				f.object_kind = kind::data;
+				stack_.back().has_data = true;
+			}
+		stack_.push_back(move(f));
+	}
+
+	void value(const string& name, const string& val) override {
+		if (stack_.empty())
+			return;
+		frame& f = stack_.back();
+		if (name == "hidden" && !f.hidden_read) {
+			// The first hidden field decides, as for the tree
+			f.hidden_read = true;
+			if (val == "true" && !f.hidden) {
+				if (index_ != f.first_index)
+					error("With --stream a hidden field must come before the images of its object.");
+				f.hidden = true;
+			}
+		}
+		if (f.object_kind != kind::data || f.hidden)
+			return;
+
+		if (name == "width" && f.width.empty())
+			f.width = val;
+		else
+			if (name == "height" && f.height.empty())
+				f.height = val;
+			else
+				if (name == "pixel" && !f.has_pixels) {
+					f.has_pixels = true;
+					if (!f.width.empty() && !f.height.empty())
+						write(f.height, f.width, val);
+					else
+						f.pixels = val;
+				}
+	}
+
+	void end_object() override {
+		const frame f = move(stack_.back());
+		stack_.pop_back();
+		if (f.hidden)
+			return;
+
+		if (f.object_kind == kind::data) {
+			if (f.width.empty() || f.height.empty() || !f.has_pixels)
+				error("Image object not formatted correctly.");
+			// The size came after the pixels
+			if (!f.pixels.empty())
+				write(f.height, f.width, f.pixels);
+		}
+		if (f.object_kind == kind::image && !f.has_data)
+			error("Image object not formatted correctly.");
+	}
+
+private:
+	enum class kind { other, image, data };
+
+	struct frame {
+		kind object_kind = kind::other;
+		bool hidden = false, hidden_read = false, has_data = false, has_pixels = false;
+		size_t first_index = 0;
+		string width, height, pixels;
+	};
+
+	const string& output_prefix_;
+	size_t index_;
+	vector<frame> stack_;
+
+	void write(const string& height, const string& width, const string& pixels) {
+		const mat<vec3b> image = decode(size_t(stoi(height)), size_t(stoi(width)), pixels);
+		write_image(image, output_prefix_, index_++);
+	}
+};
+
+void extract_stream(const string& input_filename, const string& output_prefix) {
+	if (!check_extension(input_filename, ".txt"))
+		error("Input file must be a .txt file.");
+
+	ifstream is(input_filename, ios::binary);
+	if (!is)
+		error("Can not open input file.");
+
+	try {
+		image_extractor extractor(output_prefix);
+		parse_events(is, extractor);
+	}
+	catch (const exception& e) {
+		error(e.what());
+	}
+}
 
 void extract(const string& input_filename, const string& output_prefix) {
 	if (!check_extension(input_filename, ".txt"))
 		error("Input file must be a .txt file.");
 
-	ifstream is(input_filename);
+	ifstream is(input_filename, ios::binary);
 	if (!is)
 		error("Can not open input file.");
 
-	const element root_element = parse(is);
+	try {
+		// All the images are found first, then they are decoded in parallel from the text of the document
+		const document doc(is);
 
-	size_t index = 1;
-	visit(root_element, output_prefix, index);
+		vector<image_job> jobs;
+		visit(doc.root(), jobs);
+		run_jobs(jobs, output_prefix);
+	}
+	catch (const logic_error& e) {
+		error(e.what());
+	}
 }
 
 
 
 int main(const int argc, char **argv) {
-	if (argc != 3)
+	if (argc != 3 && argc != 4)
+		syntax();
+	if (argc == 4 && string(argv[1]) != "--stream")
 		syntax();
 
-	const string input_filename(argv[1]);
-	const string output_prefix(argv[2]);
+	const string input_filename(argv[argc - 2]);
+	const string output_prefix(argv[argc - 1]);
 
-	extract(input_filename, output_prefix);
+	if (argc == 4)
+		extract_stream(input_filename, output_prefix);
+	else
+		extract(input_filename, output_prefix);
 	cout << "Done!!!\n";
 
 	return EXIT_SUCCESS;
@@ -2,6 +2,7 @@
 #include <stdexcept>
 #include <string>
 #include <iterator>
+#include <cstring>
 
 using namespace std;
 using namespace vector_graphics;
@@ -237,4 +238,188 @@ element vector_graphics::parse(istream& is) {
 	default:
 		throw logic_error("Option not recognized.");
 	}
+}
+
+
+////////////////////////////////////////////////
+/*Event driven parsing*/
+////////////////////////////////////////////////
+
+// Reads the value after its opening quote, up to a quote which is not followed by another one. The value is
+// read in runs up to the next quote, reusing the buffer of the previous value.
+static void read_value_runs(istream& is, string& val) {
+	val.clear();
+	string run;
+	for (;;) {
+		getline(is, run, '"');
+		if (!is)
+			throw logic_error("Never ending value.");
+		val += run;
+		if (is.peek() != '"')
+			return;
+		val.push_back(char(is.get()));
+	}
+}
+
+void vector_graphics::parse_events(istream& is, event_handler& handler) {
+	string id, word, val;
+	size_t depth = 0;
+	do {
+		is >> id >> ws;
+		if (!is)
+			throw logic_error("File ended with an id.");
+		switch (is.peek()) {
+		case 'o':
+			is >> word;
+			handler.begin_object(id);
+			++depth;
+			break;
+		case '"':
+			is.get();
+			read_value_runs(is, val);
+			handler.value(id, val);
+			break;
+		case 'e':
+			is >> word;
+			if (word != "end")
+				throw logic_error("Id obj not followed by an end.");
+			// A null root element is an empty document
+			if (depth == 0)
+				return;
+			handler.end_object();
+			--depth;
+			break;
+		default:
+			throw logic_error("Option not recognized.");
+		}
+	} while (depth > 0);
+}
+
+
+////////////////////////////////////////////////
+/*Document parsed in place*/
+////////////////////////////////////////////////
+
+static const node null_node{};
+
+string node::value() const {
+	if (!escaped_)
+		return string(value_);
+	string val;
+	val.reserve(value_.size());
+	for (size_t i = 0; i < value_.size(); ++i) {
+		val.push_back(value_[i]);
+		if (value_[i] == '"')
+			++i;
+	}
+	return val;
+}
+
+const node* node::find(string_view key) const {
+	for (const node* n = first_child_; n != nullptr; n = n->next_sibling_)
+		if (n->name_ == key)
+			return n;
+	return nullptr;
+}
+
+bool node::is_hidden() const {
+	for (const node* n = first_child_; n != nullptr; n = n->next_sibling_)
+		if (n->name_ == "hidden" && n->type_ == type::value)
+			return n->value() == "true";
+	return false;
+}
+
+bool node::contains(string_view key) const {
+	return find(key) != nullptr;
+}
+
+const node& node::operator[](string_view key) const {
+	const node* n = find(key);
+	return n == nullptr ? null_node : *n;
+}
+
+static inline bool is_space(const char c) {
+	return c == ' ' || c == '\n' || c == '\r' || c == '\t';
+}
+
+static inline void skip_spaces(const char*& p, const char* end) {
+	while (p != end && is_space(*p))
+		++p;
+}
+
+static inline string_view read_word(const char*& p, const char* end) {
+	const char* first = p;
+	while (p != end && !is_space(*p))
+		++p;
+	return string_view(first, p - first);
+}
+
+document::document(istream& is) {
+	is.seekg(0, ios::end);
+	const streamoff size = is.tellg();
+	is.seekg(0, ios::beg);
+	if (size < 0)
+		throw logic_error("Cannot read the document.");
+	text_.resize(size_t(size));
+	is.read(text_.data(), text_.size());
+	if (size_t(is.gcount()) != text_.size())
+		throw logic_error("Cannot read the document.");
+
+	const char* p = text_.data();
+	root_ = parse_element(p, p + text_.size());
+	if (root_ == nullptr)
+		root_ = nodes_.allocate();
+}
+
+// Same grammar as parse: an id followed by obj and the elements up to a null one, by a quoted value or by end
+// for the null element. A null element is returned as nullptr.
+node* document::parse_element(const char*& p, const char* end) {
+	skip_spaces(p, end);
+	const string_view id = read_word(p, end);
+	skip_spaces(p, end);
+	if (id.empty() || p == end)
+		throw logic_error("File ended with an id.");
+
+	switch (*p) {
+	case 'o': {
+		read_word(p, end);
+		node* n = nodes_.allocate();
+		n->name_ = id;
+		n->type_ = type::object;
+		node** last = &n->first_child_;
+		while (node* child = parse_element(p, end)) {
+			*last = child;
+			last = &child->next_sibling_;
+		}
+		return n;
+	}
+	case '"': {
+		// The value ends at a quote which is not followed by another one; "" is left in place and resolved
+		// only when the value is asked with value()
+		node* n = nodes_.allocate();
+		n->name_ = id;
+		n->type_ = type::value;
+		const char* first = ++p;
+		for (;;) {
+			p = static_cast<const char*>(memchr(p, '"', end - p));
+			if (p == nullptr)
+				throw logic_error("Never ending value.");
+			if (p + 1 != end && p[1] == '"') {
+				n->escaped_ = true;
+				p += 2;
+			}
+			else
+				break;
+		}
+		n->value_ = string_view(first, p - first);
+		++p;
+		return n;
+	}
+	case 'e':
+		if (read_word(p, end) != "end")
+			throw logic_error("Id obj not followed by an end.");
+		return nullptr;
+	default:
+		throw logic_error("Option not recognized.");
+	}
 }
\ No newline at end of file
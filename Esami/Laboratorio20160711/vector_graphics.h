@@ -4,6 +4,8 @@
 #include <vector>
 #include <memory>
 #include <iostream>
+#include <string>
+#include <string_view>
 
 namespace vector_graphics {
 	
@@ -70,6 +72,117 @@ namespace vector_graphics {
 	};
 
 	element parse(std::istream& is);
+
+
+	/**************
+	 * Allocates objects in blocks, which are all released together
+	 */
+	template<typename T, size_t BlockSize = 1024>
+	class arena {
+	public:
+		T* allocate() {
+			if (used_ == BlockSize) {
+				blocks_.emplace_back(new T[BlockSize]);
+				used_ = 0;
+			}
+			return &blocks_.back()[used_++];
+		}
+
+	private:
+		std::vector<std::unique_ptr<T[]>> blocks_;
+		size_t used_ = BlockSize;
+	};
+
+
+	/**************
+	 * Element of a document parsed in place: names and values are slices of the text of the document
+	 */
+	class node {
+	public:
+		std::string_view element_name() const {
+			return name_;
+		}
+
+		vector_graphics::type type() const {
+			return type_;
+		}
+
+		// Text between the quotes, with the "" escapes still doubled. It is the value when has_escapes is false.
+		std::string_view raw_value() const {
+			return value_;
+		}
+
+		bool has_escapes() const {
+			return escaped_;
+		}
+
+		// Copy of the value with the escapes resolved
+		std::string value() const;
+
+		const node* first_child() const {
+			return first_child_;
+		}
+
+		const node* next_sibling() const {
+			return next_sibling_;
+		}
+
+		bool is_hidden() const;
+		bool contains(std::string_view key) const;
+		const node& operator[](std::string_view key) const;
+
+	private:
+		friend class document;
+
+		std::string_view name_, value_;
+		vector_graphics::type type_ = vector_graphics::type::null;
+		bool escaped_ = false;
+		node *first_child_ = nullptr, *next_sibling_ = nullptr;
+
+		const node* find(std::string_view key) const;
+	};
+
+
+	/**************
+	 * Document read in a single buffer and parsed in place. The nodes are allocated from an arena and the
+	 * values are not copied, so the whole tree is released at once with the document.
+	 */
+	class document {
+	public:
+		explicit document(std::istream& is);
+
+		document(const document& rhs) = delete;
+		document& operator=(const document& rhs) = delete;
+		document(document&& rhs) = default;
+		document& operator=(document&& rhs) = default;
+
+		const node& root() const {
+			return *root_;
+		}
+
+	private:
+		std::vector<char> text_;
+		arena<node> nodes_;
+		node* root_;
+
+		node* parse_element(const char*& p, const char* end);
+	};
+
+
+	/**************
+	 * Event driven parsing: the elements are reported while they are read, without building a tree. A value
+	 * is passed with its escapes resolved and is valid only during the call.
+	 */
+	class event_handler {
+	public:
+		virtual void begin_object(const std::string& name) = 0;
+		virtual void value(const std::string& name, const std::string& val) = 0;
+		virtual void end_object() = 0;
+
+		virtual ~event_handler() = default;
+	};
+
+	void parse_events(std::istream& is, event_handler& handler);
 }
 
 #endif // VECTOR_GRAPHICS_H
\ No newline at end of file
@@ -8,12 +8,13 @@
 #include <cstdlib>
 #include <vector>
 #include <numeric>
+#include <thread>
 
 using namespace std;
 using namespace core;
 using namespace ppm;
 
-array<char, 85> z85_values = {
+const array<char, 85> z85_values = {
 	'0', '1', '2', '3', '4', '5', '6', '7', '8', '9',
 	'a', 'b', 'c', 'd', 'e', 'f', 'g', 'h', 'i', 'j',
 	'k', 'l', 'm', 'n', 'o', 'p', 'q', 'r', 's', 't',
@@ -25,8 +26,82 @@ array<char, 85> z85_values = {
 	'}', '@', '%', '$', '#'
 };
 
+// After k characters the alphabet has been rotated right k times by N, so the character of value v is
+// z85_values[(v - k*N) mod 85]. The alphabet is stored twice, so that this is rotated_values[v + 85 - offset]
+// with offset = k*N mod 85, and the inverse is the value in the alphabet plus the offset, mod 85.
+const array<uint32_t, 5> powers_85 = { 52200625, 614125, 7225, 85, 1 };
+
+const array<char, 170> rotated_values = []() {
+	array<char, 170> values;
+	for (size_t i = 0; i < 170; ++i)
+		values[i] = z85_values[i % 85];
+	return values;
+}();
+
+// Value of every character in the alphabet, 0xFF for the characters which are not in it
+const array<uint8_t, 256> z85_indexes = []() {
+	array<uint8_t, 256> indexes;
+	indexes.fill(0xFF);
+	for (size_t i = 0; i < z85_values.size(); ++i)
+		indexes[uint8_t(z85_values[i])] = uint8_t(i);
+	return indexes;
+}();
+
+inline void encode_group(uint32_t value, const size_t N, size_t& offset, char* out) {
+	for (size_t j = 5; j > 0; --j) {
+		out[j - 1] = char(value % 85);
+		value /= 85;
+	}
+	for (size_t j = 0; j < 5; ++j) {
+		out[j] = rotated_values[size_t(out[j]) + 85 - offset];
+		offset += N;
+		offset -= offset >= 85 ? 85 : 0;
+	}
+}
+
+// Encodes size bytes, the last group padded with zeros, starting with the alphabet rotated by offset.
+// Writes 5 characters every 4 bytes or part of them.
+void encode_bytes(const uint8_t* data, const size_t size, const size_t N, size_t offset, char* out) {
+	size_t i = 0;
+	for (; i + 4 <= size; i += 4, out += 5) {
+		const uint32_t value = uint32_t(data[i]) << 24 | uint32_t(data[i + 1]) << 16 |
+							   uint32_t(data[i + 2]) << 8 | uint32_t(data[i + 3]);
+		encode_group(value, N, offset, out);
+	}
+	if (i < size) {
+		uint32_t value = 0;
+		for (size_t k = 0; k < 4; ++k)
+			value = value << 8 | (i + k < size ? data[i + k] : 0);
+		encode_group(value, N, offset, out);
+	}
+}
+
+// Decodes the groups of 5 characters in the input up to size bytes, starting with the alphabet rotated by
+// offset. Returns false if a character is not in the alphabet or a group is not a 32 bit value.
+bool decode_chars(const char* in, const size_t size, const size_t N, size_t offset, uint8_t* data) {
+	for (size_t i = 0; i < size; i += 4, in += 5) {
+		uint64_t value = 0;
+		for (size_t j = 0; j < 5; ++j) {
+			const uint8_t index = z85_indexes[uint8_t(in[j])];
+			if (index == 0xFF)
+				return false;
+			size_t v = index + offset;
+			v -= v >= 85 ? 85 : 0;
+			value += powers_85[j] * uint64_t(v);
+			offset += N;
+			offset -= offset >= 85 ? 85 : 0;
+		}
+		if (value > UINT32_MAX)
+			return false;
+		for (size_t k = 0; k < 4 && i + k < size; ++k)
+			data[i + k] = uint8_t(value >> ((3 - k) * 8));
+	}
+	return true;
+}
+
 void syntax() {
-	cerr << "Usage: z85rot [c|d] <N> <input_filename> <output_filename>\n";
+	cerr << "Usage: z85rot [c|d] <N> <input_filename> <output_filename> [<threads>]\n";
+	cerr << "With more than one thread large images are split in chunks encoded or decoded in parallel\n";
 	exit(EXIT_FAILURE);
 }
 
@@ -39,7 +114,77 @@ inline bool check_extension(const string& filename, const string extension) {
 	return filename.substr(filename.size() - extension.size()) == extension;
 }
 
-void encode(const size_t N, const string& input_filename, const string& output_filename) {
+// The rotation depends only on the position of the character, so the data can be split at group boundaries
+// and every chunk encoded or decoded on its own, starting with the rotation of its first character.
+// Chunks are at least min_chunk_groups groups, so small images stay on one thread. An empty image gets
+// chunks of one group, so that the number of chunks is still defined.
+const size_t min_chunk_groups = 1 << 16;
+
+inline size_t chunk_groups(const size_t groups, const size_t n_threads) {
+	const size_t n_chunks = max<size_t>(1, min(n_threads, groups / min_chunk_groups));
+	return max<size_t>(1, (groups + n_chunks - 1) / n_chunks);
+}
+
+inline size_t rotation_offset(const size_t chars, const size_t N) {
+	return (chars % 85) * N % 85;
+}
+
+// Every thread encodes its chunk and writes it at its position in the output file, which must already hold
+// the header of header_size bytes
+bool encode_parallel(const uint8_t* data, const size_t tot_size, const size_t N, const string& output_filename,
+					 const size_t header_size, const size_t n_threads) {
+	const size_t groups = (tot_size + 3) / 4;
+	const size_t per_chunk = chunk_groups(groups, n_threads);
+	vector<thread> threads;
+	vector<char> failed((groups + per_chunk - 1) / per_chunk, false);
+	for (size_t first = 0, chunk = 0; first < groups; first += per_chunk, ++chunk)
+		threads.emplace_back([=, &failed]() {
+			const size_t last = min(first + per_chunk, groups);
+			const size_t first_byte = first * 4, last_byte = min(last * 4, tot_size);
+			string encoded((last - first) * 5, ' ');
+			encode_bytes(data + first_byte, last_byte - first_byte, N, rotation_offset(first * 5, N), &encoded[0]);
+
+			fstream os(output_filename, ios::in | ios::out | ios::binary);
+			os.seekp(header_size + first * 5);
+			os.write(encoded.data(), encoded.size());
+			failed[chunk] = !os;
+		});
+	for (auto& t : threads)
+		t.join();
+	return find(begin(failed), end(failed), true) == end(failed);
+}
+
+// Every thread reads its chunk from the position data_start + 5 characters every group
+string decode_parallel(const string& input_filename, const size_t data_start, const size_t N, uint8_t* data,
+					   const size_t tot_size, const size_t n_threads) {
+	const size_t groups = (tot_size + 3) / 4;
+	const size_t per_chunk = chunk_groups(groups, n_threads);
+	vector<thread> threads;
+	vector<string> errors((groups + per_chunk - 1) / per_chunk);
+	for (size_t first = 0, chunk = 0; first < groups; first += per_chunk, ++chunk)
+		threads.emplace_back([=, &errors]() {
+			const size_t last = min(first + per_chunk, groups);
+			const size_t first_byte = first * 4, last_byte = min(last * 4, tot_size);
+			string encoded((last - first) * 5, ' ');
+			ifstream is(input_filename, ios::binary);
+			is.seekg(data_start + first * 5);
+			is.read(&encoded[0], encoded.size());
+			if (size_t(is.gcount()) != encoded.size())
+				errors[chunk] = "Input file must be able to give 5 byte every time.";
+			else
+				if (!decode_chars(encoded.data(), last_byte - first_byte, N, rotation_offset(first * 5, N),
+								  data + first_byte))
+					errors[chunk] = "Input file contains characters which are not in the alphabet.";
+		});
+	for (auto& t : threads)
+		t.join();
+	for (const auto& e : errors)
+		if (!e.empty())
+			return e;
+	return "";
+}
+
+void encode(const size_t N, const string& input_filename, const string& output_filename, const size_t n_threads) {
 	if (!check_extension(input_filename, ".ppm"))
 		error("Input file must be a .ppm file.");
 	if (!check_extension(output_filename, ".z85r"))
@@ -57,35 +202,23 @@ void encode(const size_t N, const string& input_filename, const string& output_f
 		error("Cannot open the output file.");
 	os << img.width() << "," << img.height() << ",";
 	const uint8_t *data = reinterpret_cast<const uint8_t*>(img.data());
-	size_t tot_size = img.height() * img.width() * 3;
-	for (size_t i = 0; i < tot_size;) {
-		size_t k = 0;
-		uint32_t value = 0;
-		while (k++ < 4 && i < tot_size) {
-			value = value << 8;
-			uint32_t tmp = uint32_t(data[i++]);
-			value |= tmp;
-		}
-
-		if (k < 4)
-			while (k++ <= 4)
-				value = (value << 8) | 0;
-
-		array<uint32_t, 5> indexes;
-		for (size_t j = 5; j > 0; --j) {
-			uint32_t mod = value % 85;
-			indexes[j - 1] = mod;
-			value = value / 85;
-		}
-		for (const auto& v : indexes) {
-			char c = z85_values[v];
-			os << c;
-			rotate(begin(z85_values), end(z85_values) - N, end(z85_values));
-		}
+	const size_t tot_size = img.height() * img.width() * 3;
+	if (n_threads > 1) {
+		const size_t header_size = size_t(os.tellp());
+		os.close();
+		if (!encode_parallel(data, tot_size, N % 85, output_filename, header_size, n_threads))
+			error("Cannot write the output file.");
+		return;
 	}
+
+	string encoded((tot_size + 3) / 4 * 5, ' ');
+	encode_bytes(data, tot_size, N % 85, 0, &encoded[0]);
+	os.write(encoded.data(), encoded.size());
+	if (!os)
+		error("Cannot write the output file.");
 }
 
-void decode(const size_t N, const string& input_filename, const string& output_filename) {
+void decode(const size_t N, const string& input_filename, const string& output_filename, const size_t n_threads) {
 	if (!check_extension(input_filename, ".z85r"))
 		error("Input file must be a .z85r file.");
 	if (!check_extension(output_filename, ".ppm"))
@@ -102,24 +235,19 @@ void decode(const size_t N, const string& input_filename, const string& output_f
 	
 	mat<vec3b> img(height, width);
 	uint8_t *data = reinterpret_cast<uint8_t*>(img.data());
-	size_t tot_size = width * height * 3;
-	size_t readed = 0;
-	while (is.peek() != EOF && readed < tot_size) {
-		char buffer[5];
-		is.read(buffer, 5);
-		if (!is || is.gcount() != 5)
+	const size_t tot_size = width * height * 3;
+	if (n_threads > 1) {
+		const string message = decode_parallel(input_filename, size_t(is.tellg()), N % 85, data, tot_size, n_threads);
+		if (!message.empty())
+			error(message);
+	}
+	else {
+		string encoded((tot_size + 3) / 4 * 5, ' ');
+		is.read(&encoded[0], encoded.size());
+		if (size_t(is.gcount()) != encoded.size())
 			error("Input file must be able to give 5 byte every time.");
-		uint32_t value = 0;
-		for (size_t i = 0; i < 5; ++i) {
-			uint32_t pos = find(begin(z85_values), end(z85_values), buffer[i]) - begin(z85_values);
-			pos = static_cast<uint32_t>(pow(85, (4 - i)) * pos);
-			value += pos;
-			rotate(begin(z85_values), end(z85_values) - N, end(z85_values));
-		}
-		for (size_t i = 0; i < 4 && readed < tot_size; ++i) {
-			uint8_t byte = ((value & (0xFF << ((3 - i) * 8))) >> ((3 - i) * 8)) & 0xFF;
-			data[readed++] = byte;
-		}
+		if (!decode_chars(encoded.data(), tot_size, N % 85, 0, data))
+			error("Input file contains characters which are not in the alphabet.");
 	}
 
 	ofstream os(output_filename, ios::binary);
@@ -130,7 +258,7 @@ void decode(const size_t N, const string& input_filename, const string& output_f
 }
 
 int main(int argc, char **argv) {
-	if (argc != 5)
+	if (argc != 5 && argc != 6)
 		syntax();
 
 	try {
@@ -138,12 +266,15 @@ int main(int argc, char **argv) {
 		size_t N = stoi(string(argv[2]));
 		string input(argv[3]);
 		string output(argv[4]);
+		size_t n_threads = argc == 6 ? stoi(string(argv[5])) : 1;
+		if (n_threads == 0)
+			syntax();
 
 		if (command == "c")
-			encode(N, input, output);
+			encode(N, input, output, n_threads);
 		else
 			if (command == "d")
-				decode(N, input, output);
+				decode(N, input, output, n_threads);
 			else
 				error("Command parameter must be c for encoding and d for decoding.");
 
@@ -152,6 +283,6 @@ int main(int argc, char **argv) {
 		return EXIT_SUCCESS;
 	}
 	catch (exception&) {
-		error("The second parameter must be convertible to an integer.");
+		error("N and the number of threads must be convertible to integers.");
 	}
 }
\ No newline at end of file